@@ -52,6 +52,7 @@ THE SOFTWARE.
 #include "resend.h"
 #include "configuration.h"
 #include "local.h"
+#include "pool.h"
 #include "version.h"
 
 struct timeval now;
@@ -74,8 +75,12 @@ const char *logfile = NULL,
     *pidfile = "/var/run/babeld.pid",
     *state_file = "/var/lib/babel-state";
 
+/* A ring of receive_batch buffers of receive_buffer_size bytes each,
+   carved out of a single allocation. */
 unsigned char *receive_buffer = NULL;
 int receive_buffer_size = 0;
+int receive_batch = 16;
+static struct received_packet *receive_packets = NULL;
 
 const unsigned char zeroes[16] = {0};
 const unsigned char ones[16] =
@@ -257,7 +262,7 @@ main(int argc, char **argv)
             config_files[num_config_files++] = optarg;
             break;
         case 'C':
-            rc = parse_config_from_string(optarg, strlen(optarg), NULL);
+            rc = parse_config_from_string(optarg, strlen(optarg), NULL, NULL);
             if(rc != CONFIG_ACTION_DONE) {
                 fprintf(stderr,
                         "Couldn't parse configuration from command line.\n");
@@ -410,7 +415,6 @@ babel_main(char **interface_names, int num_interface_names)
 {
     struct interface *ifp;
     time_t expiry_time, source_expiry_time, kernel_dump_time;
-    struct sockaddr_in6 sin6;
     void *vrc;
     int i, fd, rc;
 
@@ -535,7 +539,14 @@ babel_main(char **interface_names, int num_interface_names)
         }
     }
 
+    local_journal_init();
+
     init_signals();
+    receive_packets = calloc(receive_batch, sizeof(struct received_packet));
+    if(receive_packets == NULL) {
+        perror("calloc(receive_packets)");
+        goto fail;
+    }
     rc = resize_receive_buffer(1500);
     if(rc < 0)
         goto fail;
@@ -588,7 +599,7 @@ babel_main(char **interface_names, int num_interface_names)
     while(1) {
         struct timeval tv;
         fd_set readfds;
-        struct neighbour *neigh;
+        struct buffered *buf;
 
         gettime(&now);
 
@@ -607,9 +618,8 @@ babel_main(char **interface_names, int num_interface_names)
             timeval_min(&tv, &ifp->update_timeout);
             timeval_min(&tv, &ifp->update_flush_timeout);
         }
-        FOR_ALL_NEIGHBOURS(neigh) {
-            timeval_min(&tv, &neigh->buf.timeout);
-        }
+        for(buf = pending_buffers; buf; buf = buf->pending_next)
+            timeval_min(&tv, &buf->timeout);
         FD_ZERO(&readfds);
         if(timeval_compare(&tv, &now) > 0) {
             int maxfd = 0;
@@ -649,29 +659,37 @@ babel_main(char **interface_names, int num_interface_names)
             filter.addr = kernel_addr_notify;
             filter.link = kernel_link_notify;
             kernel_callback(&filter);
+            apply_kernel_route_notifications();
         }
 
         if(FD_ISSET(protocol_socket, &readfds)) {
-            unsigned char to[16];
-            rc = babel_recv(protocol_socket,
-                            receive_buffer, receive_buffer_size,
-                            (struct sockaddr*)&sin6, sizeof(sin6), to);
+            rc = babel_recv_batch(protocol_socket,
+                                  receive_packets, receive_batch);
             if(rc < 0) {
-                if(errno != EAGAIN && errno != EINTR) {
+                if(errno == EAGAIN) {
+                    /* Woken up by the error queue. */
+                    collect_tx_timestamps();
+                } else if(errno != EINTR) {
                     perror("recv");
                     sleep(1);
                 }
             } else {
-                FOR_ALL_INTERFACES(ifp) {
-                    if(!if_up(ifp))
+                for(i = 0; i < rc; i++) {
+                    struct received_packet *packet = &receive_packets[i];
+                    if(packet->len < 0)
                         continue;
-                    if(ifp->ifindex == sin6.sin6_scope_id) {
-                        parse_packet((unsigned char*)&sin6.sin6_addr, ifp,
-                                     receive_buffer, rc, to);
-                        VALGRIND_MAKE_MEM_UNDEFINED(receive_buffer,
-                                                    receive_buffer_size);
-                        break;
+                    FOR_ALL_INTERFACES(ifp) {
+                        if(!if_up(ifp))
+                            continue;
+                        if(ifp->ifindex == packet->sin6.sin6_scope_id) {
+                            parse_packet((unsigned char*)
+                                         &packet->sin6.sin6_addr,
+                                         ifp, packet->buf, packet->len,
+                                         packet->to, &packet->stamp);
+                            break;
+                        }
                     }
+                    VALGRIND_MAKE_MEM_UNDEFINED(packet->buf, packet->buflen);
                 }
             }
         }
@@ -712,12 +730,17 @@ babel_main(char **interface_names, int num_interface_names)
             kernel_link_changed = 0;
         }
 
-        if(kernel_addr_changed ||
-           (kernel_check_interval > 0 && now.tv_sec >= kernel_dump_time)) {
-            rc = check_xroutes(1, !kernel_addr_changed);
+        if(kernel_addr_changed) {
+            rc = check_xaddresses(1);
             if(rc < 0)
-                fprintf(stderr, "Warning: couldn't check exported routes.\n");
+                fprintf(stderr, "Warning: couldn't check local addresses.\n");
             kernel_addr_changed = 0;
+        }
+
+        if(kernel_check_interval > 0 && now.tv_sec >= kernel_dump_time) {
+            rc = check_xroutes(1, 1);
+            if(rc < 0)
+                fprintf(stderr, "Warning: couldn't check exported routes.\n");
             kernel_dump_time = now.tv_sec + roughly(kernel_check_interval);
         }
 
@@ -737,13 +760,12 @@ babel_main(char **interface_names, int num_interface_names)
         if(now.tv_sec >= expiry_time) {
             expire_routes();
             expire_resend();
+            trim_pools();
             expiry_time = now.tv_sec + roughly(30);
         }
 
-        if(now.tv_sec >= source_expiry_time) {
-            expire_sources();
-            source_expiry_time = now.tv_sec + roughly(300);
-        }
+        if(now.tv_sec >= source_expiry_time)
+            source_expiry_time = expire_sources();
 
         FOR_ALL_INTERFACES(ifp) {
             if(!if_up(ifp))
@@ -772,12 +794,12 @@ babel_main(char **interface_names, int num_interface_names)
             }
         }
 
-        FOR_ALL_NEIGHBOURS(neigh) {
-            if(neigh->buf.timeout.tv_sec != 0) {
-                if(timeval_compare(&now, &neigh->buf.timeout) >= 0) {
-                    flushbuf(&neigh->buf, neigh->ifp);
-                }
-            }
+        buf = pending_buffers;
+        while(buf) {
+            struct buffered *next = buf->pending_next;
+            if(timeval_compare(&now, &buf->timeout) >= 0)
+                flushbuf(buf, buf->ifp);
+            buf = next;
         }
 
         if(UNLIKELY(debug || dumping)) {
@@ -938,11 +960,12 @@ int
 resize_receive_buffer(int size)
 {
     unsigned char *new;
+    int i;
 
     if(size <= receive_buffer_size)
         return 0;
 
-    new = realloc(receive_buffer, size);
+    new = realloc(receive_buffer, (size_t)size * receive_batch);
     if(new == NULL) {
         perror("realloc(receive_buffer)");
         return -1;
@@ -950,6 +973,11 @@ resize_receive_buffer(int size)
     receive_buffer = new;
     receive_buffer_size = size;
 
+    for(i = 0; i < receive_batch; i++) {
+        receive_packets[i].buf = receive_buffer + (size_t)size * i;
+        receive_packets[i].buflen = size;
+    }
+
     return 1;
 }
 
@@ -1060,6 +1088,7 @@ dump_tables(FILE *out)
     struct neighbour *neigh;
     struct xroute_stream *xroutes;
     struct route_stream *routes;
+    struct pool *pool;
 
     fprintf(out, "\n");
 
@@ -1099,6 +1128,14 @@ dump_tables(FILE *out)
         route_stream_done(routes);
     }
 
+    FOR_ALL_POOLS(pool) {
+        fprintf(out, "Pool %s live %d free %d high-water %d slabs %d.\n",
+                pool->name, pool->live, pool->free, pool->high_water,
+                pool->slabs);
+    }
+    fprintf(out, "Resends retargeted %u dropped %u wasted %u.\n",
+            resends_retargeted, resends_dropped, resends_wasted);
+
     fflush(out);
 }
 
@@ -108,6 +108,9 @@ extern int kernel_socket;
 extern int kernel_check_interval;
 extern int max_request_hopcount;
 extern int shutdown_delay_msec;
+extern int receive_batch;
+
+#define MAX_RECEIVE_BATCH 1024
 
 int babel_main(char **interface_names, int num_interface_names);
 void schedule_neighbours_check(int msecs, int override);
@@ -39,6 +39,7 @@ THE SOFTWARE.
 #include "interface.h"
 #include "route.h"
 #include "kernel.h"
+#include "xroute.h"
 #include "hmac.h"
 #include "configuration.h"
 
@@ -987,7 +988,8 @@ parse_option(int c, gnc_t gnc, void *closure, char *token)
        strcmp(token, "export-table") == 0 ||
        strcmp(token, "import-table") == 0 ||
        strcmp(token, "kernel-check-interval") == 0 ||
-       strcmp(token, "shutdown-delay-ms") == 0) {
+       strcmp(token, "shutdown-delay-ms") == 0 ||
+       strcmp(token, "receive-batch") == 0) {
         int v;
         c = getint(c, &v, gnc, closure);
         if(c < -1 || v <= 0 || v >= 0xFFFF)
@@ -1017,6 +1019,8 @@ parse_option(int c, gnc_t gnc, void *closure, char *token)
             kernel_check_interval = v;
         else if(strcmp(token, "shutdown-delay-ms") == 0)
 	    shutdown_delay_msec = v;
+        else if(strcmp(token, "receive-batch") == 0)
+            receive_batch = MIN(v, MAX_RECEIVE_BATCH);
 	else
             abort();
     } else if(strcmp(token, "link-detect") == 0 ||
@@ -1024,7 +1028,8 @@ parse_option(int c, gnc_t gnc, void *closure, char *token)
               strcmp(token, "daemonise") == 0 ||
               strcmp(token, "skip-kernel-setup") == 0 ||
               strcmp(token, "ipv6-subtrees") == 0 ||
-              strcmp(token, "reflect-kernel-metric") == 0) {
+              strcmp(token, "reflect-kernel-metric") == 0 ||
+              strcmp(token, "aggregate-redistributed") == 0) {
         int b;
         c = getbool(c, &b, gnc, closure);
         if(c < -1)
@@ -1042,6 +1047,8 @@ parse_option(int c, gnc_t gnc, void *closure, char *token)
             has_ipv6_subtrees = b;
         else if(strcmp(token, "reflect-kernel-metric") == 0)
             reflect_kernel_metric = b;
+        else if(strcmp(token, "aggregate-redistributed") == 0)
+            set_xroute_aggregation(b);
         else
             abort();
     } else if(strcmp(token, "protocol-group") == 0) {
@@ -1092,6 +1099,27 @@ parse_option(int c, gnc_t gnc, void *closure, char *token)
         if(c < -1 || h < 0)
             goto error;
         change_smoothing_half_life(h);
+    } else if(strcmp(token, "multipath-tolerance") == 0) {
+        int t;
+        c = getint(c, &t, gnc, closure);
+        if(c < -1 || t < 0 || t >= 0xFFFF)
+            goto error;
+        multipath_tolerance = t;
+    } else if(strcmp(token, "damping-half-life") == 0 ||
+              strcmp(token, "damping-suppress-threshold") == 0 ||
+              strcmp(token, "damping-reuse-threshold") == 0) {
+        int v;
+        c = getint(c, &v, gnc, closure);
+        if(c < -1 || v < 0 || v >= 0xFFFF)
+            goto error;
+        if(strcmp(token, "damping-half-life") == 0)
+            damping_half_life = v;
+        else if(v == 0)
+            goto error;
+        else if(strcmp(token, "damping-suppress-threshold") == 0)
+            damping_suppress = v;
+        else
+            damping_reuse = v;
     } else if(strcmp(token, "router-id") == 0) {
         unsigned char *id = NULL;
         c = getid(c, &id, gnc, closure);
@@ -1110,11 +1138,50 @@ parse_option(int c, gnc_t gnc, void *closure, char *token)
 
 }
 
+/* Parses the optional "since generation" argument of dump and monitor. */
+static int
+parse_since(int c, gnc_t gnc, void *closure,
+            int *have_since_return, unsigned long long *since_return)
+{
+    char *token = NULL, *end;
+    unsigned long long since;
+
+    *have_since_return = 0;
+    c = skip_whitespace(c, gnc, closure);
+    if(c < 0 || c == '\n' || c == '#')
+        return c;
+
+    c = getword(c, &token, gnc, closure);
+    if(c < -1 || strcmp(token, "since") != 0)
+        goto error;
+    free(token);
+    token = NULL;
+
+    c = getword(c, &token, gnc, closure);
+    if(c < -1)
+        goto error;
+    since = strtoull(token, &end, 10);
+    if(*end != '\0')
+        goto error;
+    free(token);
+
+    *have_since_return = 1;
+    if(since_return)
+        *since_return = since;
+    return c;
+
+ error:
+    free(token);
+    return -2;
+}
+
 static int
 parse_config_line(int c, gnc_t gnc, void *closure,
-                  int *action_return, const char **message_return)
+                  int *action_return, const char **message_return,
+                  unsigned long long *since_return)
 {
     char *token = NULL;
+    int have_since;
     if(action_return)
         *action_return = CONFIG_ACTION_DONE;
     if(message_return)
@@ -1137,15 +1204,23 @@ parse_config_line(int c, gnc_t gnc, void *closure,
             goto fail;
         *action_return = CONFIG_ACTION_QUIT;
     } else if(strcmp(token, "dump") == 0) {
+        c = parse_since(c, gnc, closure, &have_since, since_return);
+        if(c < -1)
+            goto fail;
         c = skip_eol(c, gnc, closure);
         if(c < -1 || !action_return)
             goto fail;
-        *action_return = CONFIG_ACTION_DUMP;
+        *action_return =
+            have_since ? CONFIG_ACTION_DUMP_SINCE : CONFIG_ACTION_DUMP;
     } else if(strcmp(token, "monitor") == 0) {
+        c = parse_since(c, gnc, closure, &have_since, since_return);
+        if(c < -1)
+            goto fail;
         c = skip_eol(c, gnc, closure);
         if(c < -1 || !action_return)
             goto fail;
-        *action_return = CONFIG_ACTION_MONITOR;
+        *action_return =
+            have_since ? CONFIG_ACTION_MONITOR_SINCE : CONFIG_ACTION_MONITOR;
     } else if(strcmp(token, "unmonitor") == 0) {
         c = skip_eol(c, gnc, closure);
         if(c < -1 || !action_return)
@@ -1304,7 +1379,7 @@ parse_config_from_file(const char *filename, int *line_return)
     }
 
     while(1) {
-        c = parse_config_line(c, (gnc_t)gnc_file, &s, NULL, NULL);
+        c = parse_config_line(c, (gnc_t)gnc_file, &s, NULL, NULL, NULL);
         if(c < -1) {
             *line_return = s.line;
             fclose(s.f);
@@ -1333,7 +1408,8 @@ gnc_buf(struct buf_state *s)
 }
 
 int
-parse_config_from_string(char *string, int n, const char **message_return)
+parse_config_from_string(char *string, int n, const char **message_return,
+                         unsigned long long *since_return)
 {
     int c, action;
     const char *message;
@@ -1343,7 +1419,8 @@ parse_config_from_string(char *string, int n, const char **message_return)
     if(c < 0)
         return -1;
 
-    c = parse_config_line(c, (gnc_t)gnc_buf, &s, &action, &message);
+    c = parse_config_line(c, (gnc_t)gnc_buf, &s, &action, &message,
+                          since_return);
     if(c == -1) {
         if(message_return)
             *message_return = message;
@@ -1521,6 +1598,13 @@ finalise_config()
 {
     struct filter *filter1, *filter2;
 
+    if(damping_reuse >= damping_suppress) {
+        fprintf(stderr,
+                "damping-reuse-threshold must be below "
+                "damping-suppress-threshold.\n");
+        return -1;
+    }
+
     /* redistribute local allow */
     filter1 = calloc(1, sizeof(struct filter));
     if(filter1 == NULL)
@@ -28,6 +28,8 @@ THE SOFTWARE.
 #define CONFIG_ACTION_MONITOR 3
 #define CONFIG_ACTION_UNMONITOR 4
 #define CONFIG_ACTION_NO 5
+#define CONFIG_ACTION_DUMP_SINCE 6
+#define CONFIG_ACTION_MONITOR_SINCE 7
 
 #define AUTH_TYPE_NONE 0
 #define AUTH_TYPE_SHA256 1
@@ -68,7 +70,8 @@ extern struct interface_conf *default_interface_conf;
 void flush_ifconf(struct interface_conf *if_conf);
 
 int parse_config_from_file(const char *filename, int *line_return);
-int parse_config_from_string(char *string, int n, const char **message_return);
+int parse_config_from_string(char *string, int n, const char **message_return,
+                             unsigned long long *since_return);
 int add_filter(struct filter *filter, int type);
 void renumber_filters(void);
 
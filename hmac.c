@@ -252,36 +252,28 @@ compare_hmac(const unsigned char *src, const unsigned char *dst,
     return len == hmaclen && (memcmp(buf, hmac, hmaclen) == 0);
 }
 
+/* The trailer has already been checked by index_packet. */
 int
-check_hmac(const unsigned char *packet, int packetlen, int bodylen,
+check_hmac(const unsigned char *packet, int bodylen,
+           const struct tlv *trailer, int num_trailer,
            const unsigned char *src, const unsigned char *dst,
            struct interface *ifp)
 {
-    int i = bodylen + 4;
-    int len;
+    int i;
     int rc = -1;
 
     debugf("check_hmac %s -> %s\n",
            format_address(src), format_address(dst));
-    while(i < packetlen) {
-        if(i + 2 > packetlen) {
-            fprintf(stderr, "Received truncated message.\n");
-            break;
-        }
-        len = packet[i + 1];
-        if(packet[i] == MESSAGE_MAC) {
+    for(i = 0; i < num_trailer; i++) {
+        if(trailer[i].type == MESSAGE_MAC) {
             int ok;
-            if(i + len + 2 > packetlen) {
-                fprintf(stderr, "Received truncated message.\n");
-                return -1;
-            }
             ok = compare_hmac(src, dst, packet, bodylen,
-                              packet + i + 2, len, ifp->key);
+                              packet + trailer[i].offset + 2, trailer[i].len,
+                              ifp->key);
             if(ok)
                 return 1;
             rc = 0;
         }
-        i += len + 2;
     }
     return rc;
 }
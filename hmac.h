@@ -22,12 +22,15 @@ THE SOFTWARE.
 
 #define MAX_DIGEST_LEN 32
 
+struct tlv;
+
 struct key *find_key(const char *id);
 struct key *retain_key(struct key *key);
 void release_key(struct key *key);
 struct key *add_key(char *id, int type, int len, unsigned char *value);
 int add_hmac(struct buffered *buf, struct interface *ifp,
              unsigned char *packet_header);
-int check_hmac(const unsigned char *packet, int packetlen, int bodylen,
+int check_hmac(const unsigned char *packet, int bodylen,
+               const struct tlv *trailer, int num_trailer,
                const unsigned char *src, const unsigned char *dst,
                struct interface *ifp);
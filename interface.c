@@ -492,6 +492,9 @@ interface_updown(struct interface *ifp, int up)
         ifp->buf.len = 0;
         ifp->buf.size = 0;
         free(ifp->buf.buf);
+        free(ifp->buf.requests);
+        ifp->buf.requests = NULL;
+        ifp->buf.num_requests = ifp->buf.max_requests = 0;
         ifp->num_buffered_updates = 0;
         ifp->update_bufsize = 0;
         if(ifp->buffered_updates)
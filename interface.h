@@ -21,7 +21,6 @@ THE SOFTWARE.
 */
 
 struct buffered_update {
-    unsigned char id[8];
     unsigned char prefix[16];
     unsigned char src_prefix[16];
     unsigned char plen;
@@ -29,6 +28,19 @@ struct buffered_update {
     unsigned char pad[2];
 };
 
+struct buffered_request {
+    unsigned char prefix[16];
+    unsigned char src_prefix[16];
+    unsigned char id[8];
+    unsigned short seqno;
+    unsigned char plen;
+    unsigned char src_plen;
+    unsigned char hop_count;
+    unsigned char urgent;       /* computed by flushrequests */
+    short distance;             /* likewise */
+    int order;                  /* position in the queue */
+};
+
 #define IF_TYPE_DEFAULT 0
 #define IF_TYPE_WIRED 1
 #define IF_TYPE_WIRELESS 2
@@ -116,6 +128,16 @@ struct buffered {
     /* Relative position of the Hello message in the send buffer, or
        (-1) if there is none. */
     int hello;
+    /* Unicast buffers only hold memory while they have something to
+       send, and are linked on pending_buffers in the meantime. */
+    char lazy;
+    char pending;
+    struct interface *ifp;
+    struct buffered *pending_next, *pending_prev;
+    /* Multihop requests not yet written to the buffer. */
+    struct buffered_request *requests;
+    int num_requests;
+    int max_requests;
 };
 
 #define INDEX_LEN 8
@@ -133,6 +155,7 @@ struct interface {
     unsigned char *ipv4;
     int numll;
     unsigned char (*ll)[16];
+    struct neighbour *neighs;   /* neighbours on this interface */
     struct buffered buf;
     struct buffered_update *buffered_updates;
     int num_buffered_updates;
@@ -36,6 +36,13 @@ struct kernel_route {
     unsigned char gw[16];
 };
 
+/* One member of a multipath route.  Weight is between 1 and 256. */
+struct kernel_nexthop {
+    const unsigned char *gate;
+    int ifindex;
+    int weight;
+};
+
 struct kernel_addr {
     struct in6_addr addr;
     unsigned int ifindex;
@@ -86,6 +93,12 @@ int kernel_route(int operation, int table,
                  const unsigned char *gate, int ifindex, unsigned int metric,
                  const unsigned char *newgate, int newifindex,
                  unsigned int newmetric, int newtable);
+int kernel_route_multipath(int operation, int table,
+                           const unsigned char *dest, unsigned short plen,
+                           const unsigned char *src, unsigned short src_plen,
+                           const unsigned char *pref_src,
+                           const struct kernel_nexthop *nexthops, int n,
+                           unsigned int metric);
 int kernel_dump(int operation, struct kernel_filter *filter);
 int kernel_callback(struct kernel_filter *filter);
 int if_eui64(char *ifname, int ifindex, unsigned char *eui);
@@ -1138,6 +1138,158 @@ kernel_route(int operation, int table,
     return netlink_talk(&buf.nh);
 }
 
+/* Installs (ROUTE_ADD, replacing any existing route with the same
+   destination and metric) or removes (ROUTE_FLUSH) a route with a set of
+   weighted nexthops. */
+
+int
+kernel_route_multipath(int operation, int table,
+                       const unsigned char *dest, unsigned short plen,
+                       const unsigned char *src, unsigned short src_plen,
+                       const unsigned char *pref_src,
+                       const struct kernel_nexthop *nexthops, int n,
+                       unsigned int metric)
+{
+    union { char raw[4096]; struct nlmsghdr nh; } buf;
+    struct rtmsg *rtm;
+    struct rtattr *rta, *mp;
+    struct rtnexthop *rtnh;
+    int i, ipv4, use_src;
+
+    if(!nl_setup) {
+        fprintf(stderr,"kernel_route_multipath: netlink not initialized.\n");
+        errno = EIO;
+        return -1;
+    }
+
+    if(nl_command.sock < 0) {
+        int rc = netlink_socket(&nl_command, 0);
+        if(rc < 0) {
+            int olderrno = errno;
+            perror("kernel_route_multipath: netlink_socket()");
+            errno = olderrno;
+            return -1;
+        }
+    }
+
+    if(n < 1 || n > 64 || metric >= KERNEL_INFINITY ||
+       (operation != ROUTE_ADD && operation != ROUTE_FLUSH)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ipv4 = v4mapped(dest);
+    use_src = !is_default(src, src_plen);
+    if(use_src) {
+        if(ipv4 || !has_ipv6_subtrees) {
+            errno = ENOSYS;
+            return -1;
+        }
+    }
+
+    kdebugf("kernel_route_multipath: %s %s from %s "
+            "table %d metric %d nexthops %d\n",
+            operation == ROUTE_ADD ? "replace" : "flush",
+            format_prefix(dest, plen), format_prefix(src, src_plen),
+            table, metric, n);
+
+    memset(&buf, 0, sizeof(buf));
+    if(operation == ROUTE_ADD) {
+        buf.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_REPLACE;
+        buf.nh.nlmsg_type = RTM_NEWROUTE;
+    } else {
+        buf.nh.nlmsg_flags = NLM_F_REQUEST;
+        buf.nh.nlmsg_type = RTM_DELROUTE;
+    }
+
+    rtm = NLMSG_DATA(&buf.nh);
+    rtm->rtm_family = ipv4 ? AF_INET : AF_INET6;
+    rtm->rtm_dst_len = ipv4 ? plen - 96 : plen;
+    if(use_src)
+        rtm->rtm_src_len = src_plen;
+    rtm->rtm_table = table;
+    rtm->rtm_scope = RT_SCOPE_UNIVERSE;
+    rtm->rtm_type = RTN_UNICAST;
+    rtm->rtm_protocol = RTPROT_BABEL;
+
+    rta = RTM_RTA(rtm);
+    rta->rta_type = RTA_DST;
+    if(ipv4) {
+        rta->rta_len = RTA_LENGTH(sizeof(struct in_addr));
+        memcpy(RTA_DATA(rta), dest + 12, sizeof(struct in_addr));
+    } else {
+        rta->rta_len = RTA_LENGTH(sizeof(struct in6_addr));
+        memcpy(RTA_DATA(rta), dest, sizeof(struct in6_addr));
+    }
+    rta = (struct rtattr*)((char*)rta + RTA_ALIGN(rta->rta_len));
+
+    if(use_src) {
+        rta->rta_type = RTA_SRC;
+        rta->rta_len = RTA_LENGTH(sizeof(struct in6_addr));
+        memcpy(RTA_DATA(rta), src, sizeof(struct in6_addr));
+        rta = (struct rtattr*)((char*)rta + RTA_ALIGN(rta->rta_len));
+    }
+
+    rta->rta_type = RTA_PRIORITY;
+    rta->rta_len = RTA_LENGTH(sizeof(int));
+    *(int*)RTA_DATA(rta) = metric;
+    rta = (struct rtattr*)((char*)rta + RTA_ALIGN(rta->rta_len));
+
+    if(pref_src) {
+        rta->rta_type = RTA_PREFSRC;
+        if(v4mapped(pref_src)) {
+            rta->rta_len = RTA_LENGTH(sizeof(struct in_addr));
+            memcpy(RTA_DATA(rta), pref_src + 12, sizeof(struct in_addr));
+        } else {
+            rta->rta_len = RTA_LENGTH(sizeof(struct in6_addr));
+            memcpy(RTA_DATA(rta), pref_src, sizeof(struct in6_addr));
+        }
+        rta = (struct rtattr*)((char*)rta + RTA_ALIGN(rta->rta_len));
+    }
+
+    mp = rta;
+    mp->rta_type = RTA_MULTIPATH;
+    rtnh = RTA_DATA(mp);
+    for(i = 0; i < n; i++) {
+        const unsigned char *gate = nexthops[i].gate;
+        struct rtattr *nrta;
+
+        if(v4mapped(gate) && !ipv4) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        memset(rtnh, 0, sizeof(*rtnh));
+        rtnh->rtnh_flags = RTNH_F_ONLINK;
+        rtnh->rtnh_hops = MAX(1, MIN(256, nexthops[i].weight)) - 1;
+        rtnh->rtnh_ifindex = nexthops[i].ifindex;
+
+        nrta = RTNH_DATA(rtnh);
+        if(v4mapped(gate)) {
+            nrta->rta_type = RTA_GATEWAY;
+            nrta->rta_len = RTA_LENGTH(sizeof(struct in_addr));
+            memcpy(RTA_DATA(nrta), gate + 12, sizeof(struct in_addr));
+        } else if(ipv4) {
+            /* IPv4 over IPv6 nexthop */
+            nrta->rta_type = RTA_VIA;
+            nrta->rta_len = RTA_LENGTH(sizeof(struct in6_addr) + 2);
+            *((sa_family_t*) RTA_DATA(nrta)) = AF_INET6;
+            memcpy((char*)RTA_DATA(nrta) + 2, gate, sizeof(struct in6_addr));
+        } else {
+            nrta->rta_type = RTA_GATEWAY;
+            nrta->rta_len = RTA_LENGTH(sizeof(struct in6_addr));
+            memcpy(RTA_DATA(nrta), gate, sizeof(struct in6_addr));
+        }
+        rtnh->rtnh_len = sizeof(*rtnh) + RTA_ALIGN(nrta->rta_len);
+        rtnh = RTNH_NEXT(rtnh);
+    }
+    mp->rta_len = (char*)rtnh - (char*)mp;
+
+    buf.nh.nlmsg_len = (char*)mp + RTA_ALIGN(mp->rta_len) - buf.raw;
+
+    return netlink_talk(&buf.nh);
+}
+
 static int
 parse_kernel_route_rta(struct rtmsg *rtm, int len, struct kernel_route *route)
 {
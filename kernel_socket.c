@@ -577,6 +577,18 @@ kernel_route(int operation, int table,
     return 1;
 }
 
+int
+kernel_route_multipath(int operation, int table,
+                       const unsigned char *dest, unsigned short plen,
+                       const unsigned char *src, unsigned short src_plen,
+                       const unsigned char *pref_src,
+                       const struct kernel_nexthop *nexthops, int n,
+                       unsigned int metric)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
 static void
 print_kernel_route(int add, struct kernel_route *route)
 {
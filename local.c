@@ -91,31 +91,63 @@ local_kind(int kind)
     }
 }
 
+/* Every change is numbered with a generation number, and the last
+   LOCAL_JOURNAL_SIZE changes are kept, so that a client that knows the
+   generation it has seen can catch up without a full dump.  Generations
+   start at a random epoch, held in the high 32 bits, so that a
+   generation from a previous run is never taken for one of ours. */
+
+struct journal_entry {
+    unsigned long long generation;
+    char *line;
+};
+
+static struct journal_entry journal[LOCAL_JOURNAL_SIZE];
+static unsigned long long local_epoch = 0;
+static unsigned long long local_generation = 0;
+
+void
+local_journal_init(void)
+{
+    unsigned int epoch;
+    int rc;
+
+    rc = read_random_bytes(&epoch, sizeof(epoch));
+    if(rc < 0)
+        epoch = random();
+    local_epoch = (unsigned long long)epoch << 32;
+    local_generation = local_epoch;
+}
+
+static unsigned long long
+journal_record(const char *line)
+{
+    struct journal_entry *entry;
+
+    local_generation++;
+    entry = &journal[local_generation % LOCAL_JOURNAL_SIZE];
+    free(entry->line);
+    entry->generation = local_generation;
+    /* If this fails, catching up across this entry requires a full dump. */
+    entry->line = strdup(line);
+    return local_generation;
+}
+
+/* Writes a line, which must not include the final newline.  The
+   generation is appended for clients that asked for it. */
 static void
-local_notify_interface_1(struct local_socket *s,
-                         struct interface *ifp, int kind)
+local_write_line(struct local_socket *s, const char *line,
+                 unsigned long long generation)
 {
-    char buf[512], v4[INET_ADDRSTRLEN];
+    char buf[600];
     int rc;
-    int up;
 
-    up = if_up(ifp);
-    if(up && ifp->ipv4)
-        inet_ntop(AF_INET, ifp->ipv4, v4, INET_ADDRSTRLEN);
-    else
-        v4[0] = '\0';
-    if(up)
-        rc = snprintf(buf, 512,
-                      "%s interface %s up true%s%s%s%s\n",
-                      local_kind(kind), ifp->name,
-                      ifp->numll > 0 ? " ipv6 " : "",
-                      ifp->numll > 0 ? format_address(ifp->ll[0]) : "",
-                      v4[0] ? " ipv4 " : "", v4);
+    if(s->generations && generation > 0)
+        rc = snprintf(buf, 600, "%s generation %llu\n", line, generation);
     else
-        rc = snprintf(buf, 512, "%s interface %s up false\n",
-                      local_kind(kind), ifp->name);
+        rc = snprintf(buf, 600, "%s\n", line);
 
-    if(rc < 0 || rc >= 512)
+    if(rc < 0 || rc >= 600)
         goto fail;
 
     rc = write_timeout(s->fd, buf, rc);
@@ -128,21 +160,63 @@ local_notify_interface_1(struct local_socket *s,
     return;
 }
 
-void
-local_notify_interface(struct interface *ifp, int kind)
+static void
+local_notify_line(const char *line)
 {
+    unsigned long long generation = journal_record(line);
     int i;
+
     for(i = 0; i < num_local_sockets; i++) {
         if(local_sockets[i].monitor)
-            local_notify_interface_1(&local_sockets[i], ifp, kind);
+            local_write_line(&local_sockets[i], line, generation);
     }
 }
 
-static void
-local_notify_neighbour_1(struct local_socket *s,
-                         struct neighbour *neigh, int kind)
+static int
+format_interface(char *buf, int size, struct interface *ifp, int kind)
+{
+    char v4[INET_ADDRSTRLEN];
+    int rc;
+    int up;
+
+    up = if_up(ifp);
+    if(up && ifp->ipv4)
+        inet_ntop(AF_INET, ifp->ipv4, v4, INET_ADDRSTRLEN);
+    else
+        v4[0] = '\0';
+    if(up)
+        rc = snprintf(buf, size,
+                      "%s interface %s up true%s%s%s%s",
+                      local_kind(kind), ifp->name,
+                      ifp->numll > 0 ? " ipv6 " : "",
+                      ifp->numll > 0 ? format_address(ifp->ll[0]) : "",
+                      v4[0] ? " ipv4 " : "", v4);
+    else
+        rc = snprintf(buf, size, "%s interface %s up false",
+                      local_kind(kind), ifp->name);
+
+    if(rc < 0 || rc >= size)
+        return -1;
+    return rc;
+}
+
+void
+local_notify_interface(struct interface *ifp, int kind)
+{
+    char buf[512];
+
+    /* Without a local server, nobody can ever read the journal. */
+    if(local_server_socket < 0)
+        return;
+
+    if(format_interface(buf, 512, ifp, kind) >= 0)
+        local_notify_line(buf);
+}
+
+static int
+format_neighbour(char *buf, int size, struct neighbour *neigh, int kind)
 {
-    char buf[512], rttbuf[64];
+    char rttbuf[64];
     int rc;
 
     rttbuf[0] = '\0';
@@ -153,10 +227,10 @@ local_notify_neighbour_1(struct local_socket *s,
             rttbuf[0] = '\0';
     }
 
-    rc = snprintf(buf, 512,
+    rc = snprintf(buf, size,
                   "%s neighbour %lx address %s "
                   "if %s reach %04x ureach %04x "
-                  "rxcost %u txcost %u%s cost %u\n",
+                  "rxcost %u txcost %u%s cost %u",
                   local_kind(kind),
                   /* Neighbours never move around in memory , so we can use the
                      address as a unique identifier. */
@@ -170,79 +244,76 @@ local_notify_neighbour_1(struct local_socket *s,
                   rttbuf,
                   neighbour_cost(neigh));
 
-    if(rc < 0 || rc >= 512)
-        goto fail;
-
-    rc = write_timeout(s->fd, buf, rc);
-    if(rc < 0)
-        goto fail;
-    return;
-
- fail:
-    shutdown(s->fd, 1);
-    return;
+    if(rc < 0 || rc >= size)
+        return -1;
+    return rc;
 }
 
 void
 local_notify_neighbour(struct neighbour *neigh, int kind)
 {
-    int i;
-    for(i = 0; i < num_local_sockets; i++) {
-        if(local_sockets[i].monitor)
-            local_notify_neighbour_1(&local_sockets[i], neigh, kind);
-    }
+    char buf[512];
+
+    if(local_server_socket < 0)
+        return;
+
+    if(format_neighbour(buf, 512, neigh, kind) >= 0)
+        local_notify_line(buf);
 }
 
-static void
-local_notify_xroute_1(struct local_socket *s, struct xroute *xroute, int kind)
+static int
+format_xroute(char *buf, int size, struct xroute *xroute, int kind)
 {
-    char buf[512];
     int rc;
     const char *dst_prefix = format_prefix(xroute->prefix,
                                            xroute->plen);
     const char *src_prefix = format_prefix(xroute->src_prefix,
                                            xroute->src_plen);
 
-    rc = snprintf(buf, 512, "%s xroute %s-%s prefix %s from %s metric %d\n",
+    rc = snprintf(buf, size, "%s xroute %s-%s prefix %s from %s metric %d",
                   local_kind(kind), dst_prefix, src_prefix,
                   dst_prefix, src_prefix, xroute->metric);
 
-    if(rc < 0 || rc >= 512)
-        goto fail;
-
-    rc = write_timeout(s->fd, buf, rc);
-    if(rc < 0)
-        goto fail;
-    return;
-
- fail:
-    shutdown(s->fd, 1);
-    return;
+    if(rc < 0 || rc >= size)
+        return -1;
+    return rc;
 }
 
 void
 local_notify_xroute(struct xroute *xroute, int kind)
 {
-    int i;
-    for(i = 0; i < num_local_sockets; i++) {
-        if(local_sockets[i].monitor)
-            local_notify_xroute_1(&local_sockets[i], xroute, kind);
-    }
+    char buf[512];
+
+    if(local_server_socket < 0)
+        return;
+
+    if(format_xroute(buf, 512, xroute, kind) >= 0)
+        local_notify_line(buf);
 }
 
-static void
-local_notify_route_1(struct local_socket *s, struct babel_route *route, int kind)
+static int
+format_route(char *buf, int size, struct babel_route *route, int kind)
 {
-    char buf[512];
+    char dampbuf[64];
+    unsigned int penalty, flaps;
     int rc;
     const char *dst_prefix = format_prefix(route->src->prefix,
                                            route->src->plen);
     const char *src_prefix = format_prefix(route->src->src_prefix,
                                            route->src->src_plen);
 
-    rc = snprintf(buf, 512,
+    dampbuf[0] = '\0';
+    rc = route_damping(route, &penalty, &flaps);
+    if(rc >= 0) {
+        rc = snprintf(dampbuf, 64, " penalty %u flaps %u suppressed %s",
+                      penalty, flaps, rc ? "yes" : "no");
+        if(rc < 0 || rc >= 64)
+            dampbuf[0] = '\0';
+    }
+
+    rc = snprintf(buf, size,
                   "%s route %lx prefix %s from %s installed %s "
-                  "id %s metric %d refmetric %d via %s if %s\n",
+                  "id %s metric %d refmetric %d via %s if %s%s",
                   local_kind(kind),
                   (unsigned long)route,
                   dst_prefix, src_prefix,
@@ -250,29 +321,24 @@ local_notify_route_1(struct local_socket *s, struct babel_route *route, int kind
                   format_eui64(route->src->id),
                   route_metric(route), route->refmetric,
                   format_address(route->neigh->address),
-                  route->neigh->ifp->name);
-
-    if(rc < 0 || rc >= 512)
-        goto fail;
+                  route->neigh->ifp->name,
+                  dampbuf);
 
-    rc = write_timeout(s->fd, buf, rc);
-    if(rc < 0)
-        goto fail;
-    return;
-
- fail:
-    shutdown(s->fd, 1);
-    return;
+    if(rc < 0 || rc >= size)
+        return -1;
+    return rc;
 }
 
 void
 local_notify_route(struct babel_route *route, int kind)
 {
-    int i;
-    for(i = 0; i < num_local_sockets; i++) {
-        if(local_sockets[i].monitor)
-            local_notify_route_1(&local_sockets[i], route, kind);
-    }
+    char buf[512];
+
+    if(local_server_socket < 0)
+        return;
+
+    if(format_route(buf, 512, route, kind) >= 0)
+        local_notify_line(buf);
 }
 
 static void
@@ -282,13 +348,16 @@ local_notify_all_1(struct local_socket *s)
     struct neighbour *neigh;
     struct xroute_stream *xroutes;
     struct route_stream *routes;
+    char buf[512];
 
     FOR_ALL_INTERFACES(ifp) {
-        local_notify_interface_1(s, ifp, LOCAL_ADD);
+        if(format_interface(buf, 512, ifp, LOCAL_ADD) >= 0)
+            local_write_line(s, buf, 0);
     }
 
     FOR_ALL_NEIGHBOURS(neigh) {
-        local_notify_neighbour_1(s, neigh, LOCAL_ADD);
+        if(format_neighbour(buf, 512, neigh, LOCAL_ADD) >= 0)
+            local_write_line(s, buf, 0);
     }
 
     xroutes = xroute_stream();
@@ -297,7 +366,8 @@ local_notify_all_1(struct local_socket *s)
             struct xroute *xroute = xroute_stream_next(xroutes);
             if(xroute == NULL)
                 break;
-            local_notify_xroute_1(s, xroute, LOCAL_ADD);
+            if(format_xroute(buf, 512, xroute, LOCAL_ADD) >= 0)
+                local_write_line(s, buf, 0);
         }
         xroute_stream_done(xroutes);
     }
@@ -308,13 +378,53 @@ local_notify_all_1(struct local_socket *s)
             struct babel_route *route = route_stream_next(routes);
             if(route == NULL)
                 break;
-            local_notify_route_1(s, route, LOCAL_ADD);
+            if(format_route(buf, 512, route, LOCAL_ADD) >= 0)
+                local_write_line(s, buf, 0);
         }
         route_stream_done(routes);
     }
     return;
 }
 
+static int
+journal_complete(unsigned long long since)
+{
+    unsigned long long g;
+
+    if(since < local_epoch || since > local_generation ||
+       local_generation - since > LOCAL_JOURNAL_SIZE)
+        return 0;
+
+    for(g = since + 1; g <= local_generation; g++) {
+        struct journal_entry *entry = &journal[g % LOCAL_JOURNAL_SIZE];
+        if(entry->generation != g || entry->line == NULL)
+            return 0;
+    }
+    return 1;
+}
+
+/* Sends the changes after generation since, or a full dump if some of
+   them are no longer in the journal.  Terminates with the current
+   generation. */
+static void
+local_notify_since_1(struct local_socket *s, unsigned long long since)
+{
+    unsigned long long g;
+    char buf[64];
+
+    s->generations = 1;
+
+    if(journal_complete(since)) {
+        for(g = since + 1; g <= local_generation; g++)
+            local_write_line(s, journal[g % LOCAL_JOURNAL_SIZE].line, g);
+    } else {
+        local_notify_all_1(s);
+    }
+
+    snprintf(buf, 64, "generation %llu", local_generation);
+    local_write_line(s, buf, 0);
+}
+
 int
 local_read(struct local_socket *s)
 {
@@ -322,6 +432,7 @@ local_read(struct local_socket *s)
     char *eol;
     char reply[100] = "ok\n";
     const char *message = NULL;
+    unsigned long long since;
 
     if(s->buf == NULL)
         s->buf = malloc(LOCAL_BUFSIZE);
@@ -344,7 +455,7 @@ local_read(struct local_socket *s)
             break;
         n = eol + 1 - s->buf;
 
-        rc = parse_config_from_string(s->buf, n, &message);
+        rc = parse_config_from_string(s->buf, n, &message, &since);
         switch(rc) {
         case CONFIG_ACTION_DONE:
             break;
@@ -359,6 +470,13 @@ local_read(struct local_socket *s)
             local_notify_all_1(s);
             s->monitor = 1;
             break;
+        case CONFIG_ACTION_DUMP_SINCE:
+            local_notify_since_1(s, since);
+            break;
+        case CONFIG_ACTION_MONITOR_SINCE:
+            local_notify_since_1(s, since);
+            s->monitor = 1;
+            break;
         case CONFIG_ACTION_UNMONITOR:
             s->monitor = 0;
             break;
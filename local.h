@@ -34,11 +34,16 @@ struct xroute;
 
 #define LOCAL_BUFSIZE 1024
 
+#ifndef LOCAL_JOURNAL_SIZE
+#define LOCAL_JOURNAL_SIZE 4096
+#endif
+
 struct local_socket {
     int fd;
     char *buf;
     int n;
     int monitor;
+    int generations;            /* append generation numbers to changes */
 };
 
 extern int local_server_socket;
@@ -47,6 +52,7 @@ extern int num_local_sockets;
 extern int local_server_port;
 extern char *local_server_path;
 
+void local_journal_init(void);
 void local_notify_interface(struct interface *ifp, int kind);
 void local_notify_neighbour(struct neighbour *neigh, int kind);
 void local_notify_xroute(struct xroute *xroute, int kind);
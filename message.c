@@ -24,6 +24,7 @@ THE SOFTWARE.
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <errno.h>
 #include <sys/time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -42,6 +43,7 @@ THE SOFTWARE.
 #include "message.h"
 #include "configuration.h"
 #include "hmac.h"
+#include "pool.h"
 
 unsigned char packet_header[4] = {42, 2};
 
@@ -429,9 +431,69 @@ network_address(int ae, const unsigned char *a, unsigned int len,
     return network_prefix(ae, -1, 0, a, NULL, len, a_r);
 }
 
+/* The TLVs of the packet being parsed, see index_packet. */
+static struct tlv *tlvs = NULL;
+static int max_tlvs = 0;
+
+/* Walk the packet once, checking lengths, and record where each TLV
+   lies in tlvs.  Returns the number of TLVs in the body, which are
+   followed by those in the trailer, or -1. */
+static int
+index_packet(const unsigned char *packet, int packetlen, int bodylen,
+             int *num_return)
+{
+    int i, n = 0, body;
+
+    /* A packet made of Pad1 has one TLV per byte. */
+    if(max_tlvs < packetlen) {
+        struct tlv *new = realloc(tlvs, packetlen * sizeof(struct tlv));
+        if(new == NULL) {
+            perror("realloc(tlvs)");
+            return -1;
+        }
+        tlvs = new;
+        max_tlvs = packetlen;
+    }
+
+    i = 4;
+    while(i < bodylen + 4) {
+        int len = 0;
+        if(packet[i] != MESSAGE_PAD1) {
+            if(i + 2 > bodylen + 4 || i + packet[i + 1] + 2 > bodylen + 4) {
+                fprintf(stderr, "Received truncated message.\n");
+                break;
+            }
+            len = packet[i + 1];
+        }
+        tlvs[n].offset = i;
+        tlvs[n].type = packet[i];
+        tlvs[n].len = len;
+        n++;
+        i += packet[i] == MESSAGE_PAD1 ? 1 : len + 2;
+    }
+    body = n;
+
+    i = bodylen + 4;
+    while(i < packetlen) {
+        if(i + 2 > packetlen || i + packet[i + 1] + 2 > packetlen) {
+            fprintf(stderr, "Received truncated message.\n");
+            break;
+        }
+        /* No Pad1 in the trailer. */
+        tlvs[n].offset = i;
+        tlvs[n].type = packet[i];
+        tlvs[n].len = packet[i + 1];
+        n++;
+        i += packet[i + 1] + 2;
+    }
+
+    *num_return = n;
+    return body;
+}
+
 static struct neighbour *
 preparse_packet(const unsigned char *from, struct interface *ifp,
-                const unsigned char *body, int bodylen,
+                const unsigned char *packet, int num_tlvs,
                 const unsigned char *to)
 {
     int rc, i;
@@ -440,23 +502,9 @@ preparse_packet(const unsigned char *from, struct interface *ifp,
     const unsigned char *pc = NULL, *index = NULL, *nonce = NULL;
     int index_len, nonce_len = 0;
 
-    i = 0;
-    while(i < bodylen) {
-        const unsigned char *message = body + 4 + i;
-        unsigned char len, type = message[0];
-        if(type == MESSAGE_PAD1) {
-            i++;
-            continue;
-        }
-        if(i + 2 > bodylen) {
-            fprintf(stderr, "Received truncated message.\n");
-            break;
-        }
-        len = message[1];
-        if(i + len + 2 > bodylen) {
-            fprintf(stderr, "Received truncated message.\n");
-            break;
-        }
+    for(i = 0; i < num_tlvs; i++) {
+        const unsigned char *message = packet + tlvs[i].offset;
+        unsigned char len = tlvs[i].len, type = tlvs[i].type;
         if(type == MESSAGE_PC) {
             unsigned int pcnat;
 
@@ -523,7 +571,7 @@ preparse_packet(const unsigned char *from, struct interface *ifp,
             }
         }
     done:
-        i += len + 2;
+        ;
     }
 
     if(index == NULL) {
@@ -570,12 +618,152 @@ preparse_packet(const unsigned char *from, struct interface *ifp,
     return accept_packet ? neigh : NULL;
 }
 
+/* Convert a kernel timestamp, taken on the realtime clock, to the
+   clock used by gettime. */
+static int
+stamp_time(const struct timespec *stamp, struct timeval *tv)
+{
+    struct timespec real;
+    long long age;
+    int rc;
+
+    if(stamp == NULL || stamp->tv_sec == 0)
+        return -1;
+
+    gettime(tv);
+    rc = clock_gettime(CLOCK_REALTIME, &real);
+    if(rc < 0)
+        return -1;
+
+    age = (real.tv_sec - stamp->tv_sec) * 1000000LL +
+        (real.tv_nsec - stamp->tv_nsec) / 1000;
+    /* Don't trust it if the realtime clock has been stepped. */
+    if(age < 0 || age > 1000000)
+        return -1;
+
+    tv->tv_usec -= age;
+    while(tv->tv_usec < 0) {
+        tv->tv_usec += 1000000;
+        tv->tv_sec--;
+    }
+    return 1;
+}
+
+/* Hellos carrying a timestamp are timestamped again by the kernel when
+   they hit the wire.  The difference is subtracted from the RTT when
+   the timestamp is echoed back to us. */
+
+#define TX_STAMPS 16
+
+struct tx_stamp {
+    unsigned int key;           /* the kernel's count of stamped packets */
+    unsigned int sent_us;       /* the timestamp in the Hello */
+    unsigned int delay_us;
+};
+
+/* Waiting for the kernel, oldest first, and done, newest last. */
+static struct tx_stamp pending_stamps[TX_STAMPS], done_stamps[TX_STAMPS];
+static unsigned int pending_first = 0, pending_last = 0, done_last = 0;
+static unsigned int tx_stamp_key = 0;
+
+static void
+record_tx_stamp(unsigned int sent_us)
+{
+    struct tx_stamp *stamp;
+
+    if(pending_last - pending_first >= TX_STAMPS)
+        pending_first++;
+    stamp = &pending_stamps[pending_last++ % TX_STAMPS];
+    stamp->key = tx_stamp_key++;
+    stamp->sent_us = sent_us;
+    stamp->delay_us = 0;
+}
+
+/* Whether a kernel timestamp taken at stamp_us may belong to stamp. */
+static int
+tx_stamp_fits(const struct tx_stamp *stamp, unsigned int stamp_us)
+{
+    return stamp_us - stamp->sent_us < 1000000;
+}
+
+/* Match a kernel timestamp with a pending Hello.  We trust the kernel's
+   key if it designates a Hello that fits the timestamp, and consider that
+   the older ones lost their timestamps.  Otherwise our numbering has
+   drifted from the kernel's, e.g. because a failed send used up a key,
+   and we rebase it on the oldest Hello that fits. */
+static void
+match_tx_stamp(unsigned int key, unsigned int stamp_us)
+{
+    struct tx_stamp *stamp;
+    unsigned int i, j, skew;
+
+    for(i = pending_first; i != pending_last; i++) {
+        if(pending_stamps[i % TX_STAMPS].key == key)
+            break;
+    }
+
+    if(i == pending_last ||
+       !tx_stamp_fits(&pending_stamps[i % TX_STAMPS], stamp_us)) {
+        for(i = pending_first; i != pending_last; i++) {
+            if(tx_stamp_fits(&pending_stamps[i % TX_STAMPS], stamp_us))
+                break;
+        }
+        if(i == pending_last)
+            return;
+        skew = key - pending_stamps[i % TX_STAMPS].key;
+        for(j = pending_first; j != pending_last; j++)
+            pending_stamps[j % TX_STAMPS].key += skew;
+        tx_stamp_key += skew;
+    }
+
+    stamp = &pending_stamps[i % TX_STAMPS];
+    pending_first = i + 1;
+    stamp->delay_us = stamp_us - stamp->sent_us;
+    done_stamps[done_last++ % TX_STAMPS] = *stamp;
+}
+
+void
+collect_tx_timestamps(void)
+{
+    unsigned int key;
+    struct timespec ts;
+    struct timeval tv;
+    int rc;
+
+    while(1) {
+        rc = babel_recv_tx_timestamp(protocol_socket, &key, &ts);
+        if(rc < 0) {
+            if(errno != EAGAIN && errno != EINTR)
+                perror("recv(timestamp)");
+            break;
+        }
+        if(rc == 0 || stamp_time(&ts, &tv) < 0)
+            continue;
+
+        match_tx_stamp(key, time_us(tv));
+    }
+}
+
+/* How long a Hello stamped with sent_us waited before being sent. */
+static unsigned int
+tx_stamp_delay(unsigned int sent_us)
+{
+    int i;
+
+    collect_tx_timestamps();
+    for(i = 0; i < TX_STAMPS; i++) {
+        if(done_stamps[i].sent_us == sent_us)
+            return done_stamps[i].delay_us;
+    }
+    return 0;
+}
+
 void
 parse_packet(const unsigned char *from, struct interface *ifp,
              const unsigned char *packet, int packetlen,
-             const unsigned char *to)
+             const unsigned char *to, const struct timespec *stamp)
 {
-    int i;
+    int i, num_body, num_tlvs;
     const unsigned char *message;
     unsigned char type, len;
     int bodylen;
@@ -588,11 +776,16 @@ parse_packet(const unsigned char *from, struct interface *ifp,
     int have_hello_rtt = 0;
     /* Content of the RTT sub-TLV on IHU messages. */
     unsigned int hello_send_us = 0, hello_rtt_receive_time = 0;
+    struct timeval receive_time;
 
     if((ifp->flags & IF_TIMESTAMPS) != 0) {
-        /* We want to track exactly when we received this packet. */
+        /* We want to track exactly when we received this packet,
+           preferably from when it was queued by the kernel. */
         gettime(&now);
     }
+    if(stamp_time(stamp, &receive_time) < 0 ||
+       timeval_compare(&receive_time, &now) > 0)
+        receive_time = now;
 
     if(!linklocal(from)) {
         fprintf(stderr, "Received packet from non-local address %s.\n",
@@ -621,8 +814,13 @@ parse_packet(const unsigned char *from, struct interface *ifp,
         bodylen = packetlen - 4;
     }
 
+    num_body = index_packet(packet, packetlen, bodylen, &num_tlvs);
+    if(num_body < 0)
+        return;
+
     if(ifp->key != NULL) {
-        int rc = check_hmac(packet, packetlen, bodylen, from, to, ifp);
+        int rc = check_hmac(packet, bodylen, tlvs + num_body,
+                            num_tlvs - num_body, from, to, ifp);
         if(rc <= 0) {
             if(rc < 0)
                 debugf("Received unsigned packet.\n");
@@ -631,7 +829,7 @@ parse_packet(const unsigned char *from, struct interface *ifp,
             if(!(ifp->flags & IF_ACCEPT_BAD_SIGNATURES))
                 return;
         } else {
-            neigh = preparse_packet(from, ifp, packet, bodylen, to);
+            neigh = preparse_packet(from, ifp, packet, num_body, to);
             if(neigh == NULL) {
                 debugf("PC check failed.\n");
                 return;
@@ -646,25 +844,19 @@ parse_packet(const unsigned char *from, struct interface *ifp,
         return;
     }
 
-    i = 0;
-    while(i < bodylen) {
-        message = packet + 4 + i;
-        type = message[0];
+    /* Route selection is done once per destination at the end of the
+       packet. */
+    begin_route_batch();
+
+    for(i = 0; i < num_body; i++) {
+        message = packet + tlvs[i].offset;
+        type = tlvs[i].type;
+        len = tlvs[i].len;
         if(type == MESSAGE_PAD1) {
             debugf("Received pad1 from %s on %s.\n",
                    format_address(from), ifp->name);
-            i++;
             continue;
         }
-        if(i + 2 > bodylen) {
-            fprintf(stderr, "Received truncated message.\n");
-            break;
-        }
-        len = message[1];
-        if(i + len + 2 > bodylen) {
-            fprintf(stderr, "Received truncated message.\n");
-            break;
-        }
 
         if(type == MESSAGE_PADN) {
             debugf("Received pad%d from %s on %s.\n",
@@ -715,7 +907,7 @@ parse_packet(const unsigned char *from, struct interface *ifp,
                 schedule_neighbours_check(interval * 15, 0);
             if(have_timestamp) {
                 neigh->hello_send_us = timestamp;
-                neigh->hello_rtt_receive_time = now;
+                neigh->hello_rtt_receive_time = receive_time;
                 have_hello_rtt = 1;
             }
         } else if(type == MESSAGE_IHU) {
@@ -958,6 +1150,8 @@ parse_packet(const unsigned char *from, struct interface *ifp,
             unsigned char prefix[16], src_prefix[16], plen, src_plen;
             int rc, is_ss;
             if(len < 2) goto fail;
+            /* Answer with the routes selected after any earlier updates. */
+            flush_route_batch();
             if(!known_ae(message[2])) {
                 debugf("Received request with unknown AE %d. Ignoring.\n",
                        message[2]);
@@ -1012,6 +1206,7 @@ parse_packet(const unsigned char *from, struct interface *ifp,
             unsigned char prefix[16], src_prefix[16], plen, src_plen;
             unsigned short seqno;
             int rc, is_ss;
+            flush_route_batch();
             if(len < 14) goto fail;
             if(!known_ae(message[2])) {
                 debugf("Received mh_request with unknown AE %d. Ignoring.\n",
@@ -1055,7 +1250,6 @@ parse_packet(const unsigned char *from, struct interface *ifp,
                    type, format_address(from), ifp->name);
         }
     done:
-        i += len + 2;
         continue;
 
     fail:
@@ -1064,6 +1258,8 @@ parse_packet(const unsigned char *from, struct interface *ifp,
         goto done;
     }
 
+    end_route_batch();
+
     /* We can calculate the RTT to this neighbour. */
     if(have_hello_rtt && hello_send_us && hello_rtt_receive_time) {
         int remote_waiting_us, local_waiting_us;
@@ -1072,7 +1268,7 @@ parse_packet(const unsigned char *from, struct interface *ifp,
         int changed = 0;
         remote_waiting_us = neigh->hello_send_us - hello_rtt_receive_time;
         local_waiting_us = time_us(neigh->hello_rtt_receive_time) -
-            hello_send_us;
+            hello_send_us - tx_stamp_delay(hello_send_us);
 
         /* Sanity checks (validity window of 10 minutes). */
         if(remote_waiting_us < 0 || local_waiting_us < 0 ||
@@ -1105,7 +1301,8 @@ parse_packet(const unsigned char *from, struct interface *ifp,
 }
 
 static int
-fill_rtt_message(struct buffered *buf, struct interface *ifp)
+fill_rtt_message(struct buffered *buf, struct interface *ifp,
+                 unsigned int *time_return)
 {
     if((ifp->flags & IF_TIMESTAMPS) != 0 && (buf->hello >= 0)) {
         if(buf->buf[buf->hello + 8] == SUBTLV_PADN &&
@@ -1116,6 +1313,7 @@ fill_rtt_message(struct buffered *buf, struct interface *ifp)
             gettime(&now);
             time = time_us(now);
             DO_HTONL(buf->buf + buf->hello + 10, time);
+            *time_return = time;
             return 1;
         } else {
             fprintf(stderr,
@@ -1127,21 +1325,111 @@ fill_rtt_message(struct buffered *buf, struct interface *ifp)
     return 0;
 }
 
+struct buffered *pending_buffers = NULL;
+
+/* Storage for lazy buffers, by size; larger ones are malloced.  The
+   classes are sized so that a whole number of buffers fills a slab. */
+static struct pool buffer_pools[] = {
+    POOL_INITIALIZER("buffer-1k", POOL_FIT(16)),
+    POOL_INITIALIZER("buffer-2k", POOL_FIT(8)),
+    POOL_INITIALIZER("buffer-4k", POOL_FIT(4)),
+    POOL_INITIALIZER("buffer-8k", POOL_FIT(2)),
+};
+
+static struct pool *
+buffer_pool(int size)
+{
+    int i;
+    for(i = 0; i < (int)(sizeof(buffer_pools) / sizeof(buffer_pools[0])); i++) {
+        if(size <= (int)buffer_pools[i].size)
+            return &buffer_pools[i];
+    }
+    return NULL;
+}
+
+static int
+attach_buffer(struct buffered *buf)
+{
+    struct pool *pool = buffer_pool(buf->size);
+    buf->buf = pool ? pool_alloc(pool) : malloc(buf->size);
+    if(buf->buf == NULL) {
+        perror("malloc(buf)");
+        return -1;
+    }
+    return 1;
+}
+
+static void
+release_buffer(struct buffered *buf)
+{
+    struct pool *pool = buffer_pool(buf->size);
+    if(pool)
+        pool_free(pool, buf->buf);
+    else
+        free(buf->buf);
+    buf->buf = NULL;
+}
+
+static void
+set_pending(struct buffered *buf, int pending)
+{
+    if(!buf->pending == !pending)
+        return;
+
+    if(pending) {
+        buf->pending_prev = NULL;
+        buf->pending_next = pending_buffers;
+        if(pending_buffers)
+            pending_buffers->pending_prev = buf;
+        pending_buffers = buf;
+    } else {
+        if(buf->pending_prev)
+            buf->pending_prev->pending_next = buf->pending_next;
+        else
+            pending_buffers = buf->pending_next;
+        if(buf->pending_next)
+            buf->pending_next->pending_prev = buf->pending_prev;
+        buf->pending_next = buf->pending_prev = NULL;
+    }
+    buf->pending = !!pending;
+}
+
+/* Drop whatever a lazy buffer holds, without sending it. */
+void
+discard_buffer(struct buffered *buf)
+{
+    set_pending(buf, 0);
+    release_buffer(buf);
+    free(buf->requests);
+    buf->requests = NULL;
+    buf->num_requests = buf->max_requests = 0;
+    buf->len = 0;
+    buf->hello = -1;
+    buf->timeout.tv_sec = 0;
+    buf->timeout.tv_usec = 0;
+}
+
+static void flushrequests(struct buffered *buf, struct interface *ifp);
+
 void
 flushbuf(struct buffered *buf, struct interface *ifp)
 {
     int rc;
-    int end = buf->len;
+    int end;
+
+    flushrequests(buf, ifp);
+    end = buf->len;
 
     assert(buf->len <= buf->size);
 
     if(buf->len > 0) {
-        int probe;
+        int probe, stamped;
+        unsigned int stamp_us = 0;
         if(ifp->key != NULL && ifp->key->type != AUTH_TYPE_NONE)
             send_pc(buf, ifp);
         debugf("  (flushing %d buffered bytes)\n", buf->len);
         DO_HTONS(packet_header + 2, buf->len);
-        fill_rtt_message(buf, ifp);
+        stamped = fill_rtt_message(buf, ifp, &stamp_us) > 0;
         if(ifp->key != NULL && ifp->key->type != AUTH_TYPE_NONE) {
             end = add_hmac(buf, ifp, packet_header);
             if(end < 0) {
@@ -1175,9 +1463,11 @@ flushbuf(struct buffered *buf, struct interface *ifp)
                         packet_header, sizeof(packet_header),
                         buf->buf, end,
                         (struct sockaddr*)&buf->sin6,
-                        sizeof(buf->sin6), probe);
+                        sizeof(buf->sin6), probe, &stamped);
         if(rc < 0)
             perror("send");
+        else if(stamped)
+            record_tx_stamp(stamp_us);
     }
     VALGRIND_MAKE_MEM_UNDEFINED(buf->buf, buf->size);
     buf->len = 0;
@@ -1187,11 +1477,17 @@ flushbuf(struct buffered *buf, struct interface *ifp)
     buf->have_prefix = 0;
     buf->timeout.tv_sec = 0;
     buf->timeout.tv_usec = 0;
+    if(buf->lazy) {
+        set_pending(buf, 0);
+        release_buffer(buf);
+    }
 }
 
 static void
 schedule_flush_ms(struct buffered *buf, int msecs)
 {
+    if(buf->lazy)
+        set_pending(buf, 1);
     if(buf->timeout.tv_sec != 0 &&
        timeval_minus_msec(&buf->timeout, &now) < msecs)
         return;
@@ -1219,7 +1515,7 @@ ensure_space(struct buffered *buf, struct interface *ifp, int space)
         flushbuf(buf, ifp);
 }
 
-static void
+static int
 start_message(struct buffered *buf, struct interface *ifp, int type, int len)
 {
     int space = ifp->key == NULL
@@ -1227,8 +1523,13 @@ start_message(struct buffered *buf, struct interface *ifp, int type, int len)
         : len + 2 + MAX_HMAC_SPACE + 6 + INDEX_LEN;
     if(buf->size - buf->len < space)
         flushbuf(buf, ifp);
+    if(buf->buf == NULL) {
+        if(!buf->lazy || attach_buffer(buf) < 0)
+            return -1;
+    }
     buf->buf[buf->len++] = type;
     buf->buf[buf->len++] = len;
+    return 1;
 }
 
 static void
@@ -1295,7 +1596,8 @@ send_ack(struct neighbour *neigh, unsigned short nonce, unsigned short interval)
 {
     debugf("Sending ack (%04x) to %s on %s.\n",
            nonce, format_address(neigh->address), neigh->ifp->name);
-    start_message(&neigh->buf, neigh->ifp, MESSAGE_ACK, 2);
+    if(start_message(&neigh->buf, neigh->ifp, MESSAGE_ACK, 2) < 0)
+        return;
     accumulate_short(&neigh->buf, nonce);
     end_message(&neigh->buf, MESSAGE_ACK, 2);
     /* Roughly yields a value no larger than 3/2, so this meets the deadline */
@@ -1318,7 +1620,9 @@ send_challenge_request(struct neighbour *neigh)
         perror("read_random_bytes");
         return -2;
     }
-    start_message(&neigh->buf, neigh->ifp, MESSAGE_CHALLENGE_REQUEST, NONCE_LEN);
+    if(start_message(&neigh->buf, neigh->ifp,
+                     MESSAGE_CHALLENGE_REQUEST, NONCE_LEN) < 0)
+        return -1;
     accumulate_bytes(&neigh->buf, neigh->nonce, NONCE_LEN);
     end_message(&neigh->buf, MESSAGE_CHALLENGE_REQUEST, NONCE_LEN);
     gettime(&now);
@@ -1338,7 +1642,9 @@ send_challenge_reply(struct neighbour *neigh, const unsigned char *crypto_nonce,
 
     debugf("Sending challenge reply to %s on %s.\n",
            format_address(neigh->address), neigh->ifp->name);
-    start_message(&neigh->buf, neigh->ifp, MESSAGE_CHALLENGE_REPLY, len);
+    if(start_message(&neigh->buf, neigh->ifp,
+                     MESSAGE_CHALLENGE_REPLY, len) < 0)
+        return -1;
     accumulate_bytes(&neigh->buf, crypto_nonce, len);
     end_message(&neigh->buf, MESSAGE_CHALLENGE_REPLY, len);
     gettime(&now);
@@ -1352,7 +1658,8 @@ buffer_hello(struct buffered *buf, struct interface *ifp,
              unsigned short seqno, unsigned interval, int unicast)
 {
     int timestamp = !!(ifp->flags & IF_TIMESTAMPS);
-    start_message(buf, ifp, MESSAGE_HELLO, timestamp ? 12 : 6);
+    if(start_message(buf, ifp, MESSAGE_HELLO, timestamp ? 12 : 6) < 0)
+        return;
     buf->hello = buf->len - 2;
     accumulate_short(buf, unicast ? 0x8000 : 0);
     accumulate_short(buf, seqno);
@@ -1474,7 +1781,8 @@ really_buffer_update(struct buffered *buf, struct interface *ifp,
             ae = AE_IPV4;
             if(!buf->have_nh ||
                memcmp(buf->nh, ifp->ipv4, 4) != 0) {
-                start_message(buf, ifp, MESSAGE_NH, 6);
+                if(start_message(buf, ifp, MESSAGE_NH, 6) < 0)
+                    return;
                 accumulate_byte(buf, AE_IPV4);
                 accumulate_byte(buf, 0);
                 accumulate_bytes(buf, ifp->ipv4, 4);
@@ -1508,7 +1816,8 @@ really_buffer_update(struct buffered *buf, struct interface *ifp,
         if(real_plen == 128 && memcmp(real_prefix + 8, id, 8) == 0) {
             flags |= 0x40;
         } else {
-            start_message(buf, ifp, MESSAGE_ROUTER_ID, 10);
+            if(start_message(buf, ifp, MESSAGE_ROUTER_ID, 10) < 0)
+                return;
             accumulate_short(buf, 0);
             accumulate_bytes(buf, id, 8);
             end_message(buf, MESSAGE_ROUTER_ID, 10);
@@ -1522,7 +1831,8 @@ really_buffer_update(struct buffered *buf, struct interface *ifp,
     if(is_ss)
         len += 3 + spb;
 
-    start_message(buf, ifp, MESSAGE_UPDATE, len);
+    if(start_message(buf, ifp, MESSAGE_UPDATE, len) < 0)
+        return;
     accumulate_byte(buf, ae);
     accumulate_byte(buf, flags);
     accumulate_byte(buf, real_plen);
@@ -1555,12 +1865,10 @@ really_send_update(struct interface *ifp, const unsigned char *id,
 
     if((ifp->flags & IF_UNICAST) != 0) {
         struct neighbour *neigh;
-        FOR_ALL_NEIGHBOURS(neigh) {
-            if(neigh->ifp == ifp) {
-                really_buffer_update(&neigh->buf, ifp, id,
-                                     prefix, plen, src_prefix, src_plen,
-                                     seqno, metric);
-            }
+        FOR_INTERFACE_NEIGHBOURS(neigh, ifp) {
+            really_buffer_update(&neigh->buf, ifp, id,
+                                 prefix, plen, src_prefix, src_plen,
+                                 seqno, metric);
         }
     } else {
         really_buffer_update(&ifp->buf, ifp, id,
@@ -1569,15 +1877,27 @@ really_send_update(struct interface *ifp, const unsigned char *id,
     }
 }
 
+/* A buffered update together with its router-id, resolved once before
+   sorting. */
+struct sorted_update {
+    const unsigned char *id;
+    const struct buffered_update *update;
+};
+
 static int
 compare_buffered_updates(const void *av, const void *bv)
 {
-    const struct buffered_update *a = av, *b = bv;
+    const struct sorted_update *sa = av, *sb = bv;
+    const struct buffered_update *a = sa->update, *b = sb->update;
+    const unsigned char *ida = sa->id, *idb = sb->id;
     int rc, v4a, v4b, ma, mb;
 
-    rc = memcmp(a->id, b->id, 8);
-    if(rc != 0)
-        return rc;
+    /* Updates from the same source share the same id. */
+    if(ida != idb) {
+        rc = memcmp(ida, idb, 8);
+        if(rc != 0)
+            return rc;
+    }
 
     v4a = (a->plen >= 96 && v4mapped(a->prefix));
     v4b = (b->plen >= 96 && v4mapped(b->prefix));
@@ -1587,8 +1907,8 @@ compare_buffered_updates(const void *av, const void *bv)
     else if(v4a < v4b)
         return -1;
 
-    ma = (!v4a && a->plen == 128 && memcmp(a->prefix + 8, a->id, 8) == 0);
-    mb = (!v4b && b->plen == 128 && memcmp(b->prefix + 8, b->id, 8) == 0);
+    ma = (!v4a && a->plen == 128 && memcmp(a->prefix + 8, ida, 8) == 0);
+    mb = (!v4b && b->plen == 128 && memcmp(b->prefix + 8, idb, 8) == 0);
 
     if(ma > mb)
         return -1;
@@ -1632,6 +1952,7 @@ flushupdates(struct interface *ifp)
 
     if(ifp->num_buffered_updates > 0) {
         struct buffered_update *b = ifp->buffered_updates;
+        struct sorted_update *sorted;
         int n = ifp->num_buffered_updates;
 
         ifp->buffered_updates = NULL;
@@ -1647,35 +1968,47 @@ flushupdates(struct interface *ifp)
         /* In order to send fewer update messages, we want to send updates
            with the same router-id together, with IPv6 going out before IPv4. */
 
+        sorted = malloc(n * sizeof(struct sorted_update));
+        if(sorted == NULL) {
+            perror("malloc(sorted_update)");
+            goto done;
+        }
         for(i = 0; i < n; i++) {
             route = find_installed_route(b[i].prefix, b[i].plen,
                                          b[i].src_prefix, b[i].src_plen);
-            if(route)
-                memcpy(b[i].id, route->src->id, 8);
-            else
-                memcpy(b[i].id, myid, 8);
+            sorted[i].id = route ? route->src->id : myid;
+            sorted[i].update = &b[i];
         }
 
-        qsort(b, n, sizeof(struct buffered_update), compare_buffered_updates);
+        qsort(sorted, n, sizeof(struct sorted_update),
+              compare_buffered_updates);
 
         for(i = 0; i < n; i++) {
+            const struct buffered_update *u = sorted[i].update;
+
             /* The same update may be scheduled multiple times before it is
                sent out.  Since our buffer is now sorted, it is enough to
                compare with the previous update. */
 
             if(last_prefix &&
-               b[i].plen == last_plen &&
-               b[i].src_plen == last_src_plen &&
-               memcmp(b[i].prefix, last_prefix, 16) == 0 &&
-               memcmp(b[i].src_prefix, last_src_prefix, 16) == 0)
+               u->plen == last_plen &&
+               u->src_plen == last_src_plen &&
+               memcmp(u->prefix, last_prefix, 16) == 0 &&
+               memcmp(u->src_prefix, last_src_prefix, 16) == 0)
                 continue;
 
-            xroute = find_xroute(b[i].prefix, b[i].plen,
-                                 b[i].src_prefix, b[i].src_plen);
-            route = find_installed_route(b[i].prefix, b[i].plen,
-                                         b[i].src_prefix, b[i].src_plen);
+            xroute = find_xroute(u->prefix, u->plen,
+                                 u->src_prefix, u->src_plen);
+            route = find_installed_route(u->prefix, u->plen,
+                                         u->src_prefix, u->src_plen);
 
-            if(xroute && (!route || xroute->metric <= kernel_metric)) {
+            if(xroute && xroute->suppressed) {
+                /* Covered by one of our aggregates. */
+                really_send_update(ifp, myid,
+                                   u->prefix, u->plen,
+                                   u->src_prefix, u->src_plen,
+                                   myseqno, INFINITY);
+            } else if(xroute && (!route || xroute->metric <= kernel_metric)) {
                 really_send_update(ifp, myid,
                                    xroute->prefix, xroute->plen,
                                    xroute->src_prefix, xroute->src_plen,
@@ -1715,18 +2048,17 @@ flushupdates(struct interface *ifp)
             /* There's no route for this prefix.  This can happen shortly
                after an xroute has been retracted, so send a retraction. */
                 really_send_update(ifp, myid,
-                                   b[i].prefix, b[i].plen,
-                                   b[i].src_prefix, b[i].src_plen,
+                                   u->prefix, u->plen,
+                                   u->src_prefix, u->src_plen,
                                    myseqno, INFINITY);
             }
         }
+        free(sorted);
 
         if((ifp->flags & IF_UNICAST) != 0) {
             struct neighbour *neigh;
-            FOR_ALL_NEIGHBOURS(neigh) {
-                if(neigh->ifp == ifp) {
-                    schedule_flush_now(&neigh->buf);
-                }
+            FOR_INTERFACE_NEIGHBOURS(neigh, ifp) {
+                schedule_flush_now(&neigh->buf);
             }
         } else {
             schedule_flush_now(&ifp->buf);
@@ -1862,13 +2194,14 @@ send_update_resend(struct interface *ifp,
 
     send_update(ifp, 1, prefix, plen, src_prefix, src_plen);
     record_resend(RESEND_UPDATE, prefix, plen, src_prefix, src_plen,
-                  0, NULL, NULL, resend_delay);
+                  0, NULL, NULL, NULL, resend_delay);
 }
 
 void
 buffer_wildcard_retraction(struct buffered *buf, struct interface *ifp)
 {
-    start_message(buf, ifp, MESSAGE_UPDATE, 10);
+    if(start_message(buf, ifp, MESSAGE_UPDATE, 10) < 0)
+        return;
     accumulate_byte(buf, AE_WILDCARD);
     accumulate_byte(buf, 0);
     accumulate_byte(buf, 0);
@@ -1897,10 +2230,8 @@ send_wildcard_retraction(struct interface *ifp)
 
     if((ifp->flags & IF_UNICAST) != 0) {
         struct neighbour *neigh;
-        FOR_ALL_NEIGHBOURS(neigh) {
-            if(neigh->ifp == ifp) {
-                buffer_wildcard_retraction(&neigh->buf, neigh->ifp);
-            }
+        FOR_INTERFACE_NEIGHBOURS(neigh, ifp) {
+            buffer_wildcard_retraction(&neigh->buf, neigh->ifp);
         }
     } else {
         buffer_wildcard_retraction(&ifp->buf, ifp);
@@ -1934,6 +2265,8 @@ send_self_update(struct interface *ifp)
         while(1) {
             struct xroute *xroute = xroute_stream_next(xroutes);
             if(xroute == NULL) break;
+            if(xroute->suppressed)
+                continue;
             send_update(ifp, 0, xroute->prefix, xroute->plen,
                         xroute->src_prefix, xroute->src_plen);
         }
@@ -1953,7 +2286,8 @@ buffer_ihu(struct buffered *buf, struct interface *ifp, unsigned short rxcost,
     ll = linklocal(address);
     msglen = (ll ? 14 : 22) + (rtt_data ? 10 : 0);
 
-    start_message(buf, ifp, MESSAGE_IHU, msglen);
+    if(start_message(buf, ifp, MESSAGE_IHU, msglen) < 0)
+        return;
     accumulate_byte(buf, ll ? AE_IPV6_LOCAL : AE_IPV6);
     accumulate_byte(buf, 0);
     accumulate_short(buf, rxcost);
@@ -1990,10 +2324,8 @@ send_ihu(struct neighbour *neigh, struct interface *ifp)
 
     if(neigh == NULL) {
         struct neighbour *ngh;
-        FOR_ALL_NEIGHBOURS(ngh) {
-            if(ngh->ifp == ifp)
-                send_ihu(ngh, ifp);
-        }
+        FOR_INTERFACE_NEIGHBOURS(ngh, ifp)
+            send_ihu(ngh, ifp);
         return;
     }
 
@@ -2049,9 +2381,15 @@ void
 send_marginal_ihu(struct interface *ifp)
 {
     struct neighbour *neigh;
-    FOR_ALL_NEIGHBOURS(neigh) {
-        if(ifp && neigh->ifp != ifp)
-            continue;
+
+    if(ifp == NULL) {
+        struct interface *ifp_aux;
+        FOR_ALL_INTERFACES(ifp_aux)
+            send_marginal_ihu(ifp_aux);
+        return;
+    }
+
+    FOR_INTERFACE_NEIGHBOURS(neigh, ifp) {
         if(neigh->txcost >= 384 || (neigh->hello.reach & 0xF000) != 0xF000)
             send_ihu(neigh, ifp);
     }
@@ -2073,7 +2411,8 @@ send_request(struct buffered *buf, struct interface *ifp,
     if(!prefix) {
         assert(!src_prefix);
         debugf("sending request for any.\n");
-        start_message(buf, ifp, MESSAGE_REQUEST, 2);
+        if(start_message(buf, ifp, MESSAGE_REQUEST, 2) < 0)
+            return;
         accumulate_byte(buf, AE_WILDCARD);
         accumulate_byte(buf, 0);
         end_message(buf, MESSAGE_REQUEST, 2);
@@ -2089,7 +2428,8 @@ send_request(struct buffered *buf, struct interface *ifp,
     spb = v4 ? ((src_plen - 96) + 7) / 8 : (src_plen + 7) / 8;
     len = 2 + pb + (is_ss ? 3 + spb : 0);
 
-    start_message(buf, ifp, MESSAGE_REQUEST, len);
+    if(start_message(buf, ifp, MESSAGE_REQUEST, len) < 0)
+        return;
     accumulate_byte(buf, v4 ? AE_IPV4 : AE_IPV6);
     accumulate_byte(buf, v4 ? plen - 96 : plen);
     if(v4)
@@ -2131,11 +2471,9 @@ send_multicast_request(struct interface *ifp,
 
     if((ifp->flags & IF_UNICAST) != 0) {
         struct neighbour *neigh;
-        FOR_ALL_NEIGHBOURS(neigh) {
-            if(neigh->ifp == ifp) {
-                send_request(&neigh->buf, ifp, prefix, plen,
-                             src_prefix, src_plen);
-            }
+        FOR_INTERFACE_NEIGHBOURS(neigh, ifp) {
+            send_request(&neigh->buf, ifp, prefix, plen,
+                         src_prefix, src_plen);
         }
     } else {
         send_request(&ifp->buf, ifp, prefix, plen, src_prefix, src_plen);
@@ -2176,7 +2514,8 @@ send_multihop_request(struct buffered *buf, struct interface *ifp,
     spb = v4 ? ((src_plen - 96) + 7) / 8 : (src_plen + 7) / 8;
     len = 6 + 8 + pb + (is_ss ? 3 + spb : 0);
 
-    start_message(buf, ifp, MESSAGE_MH_REQUEST, len);
+    if(start_message(buf, ifp, MESSAGE_MH_REQUEST, len) < 0)
+        return;
     accumulate_byte(buf, v4 ? AE_IPV4 : AE_IPV6);
     accumulate_byte(buf, v4 ? plen - 96 : plen);
     accumulate_short(buf, seqno);
@@ -2201,6 +2540,141 @@ send_multihop_request(struct buffered *buf, struct interface *ifp,
     end_message(buf, MESSAGE_MH_REQUEST, len);
 }
 
+/* Multihop requests are queued on the buffer they are destined to, and
+   only written out when the buffer is flushed, so that a burst of
+   requests is deduplicated and packed into as few packets as possible. */
+
+static void
+buffer_request(struct buffered *buf, struct interface *ifp,
+               const unsigned char *prefix, unsigned char plen,
+               const unsigned char *src_prefix, unsigned char src_plen,
+               unsigned short seqno, const unsigned char *id,
+               unsigned short hop_count)
+{
+    struct buffered_request *b;
+
+    if(buf->num_requests == 0)
+        /* make sure any buffered updates go out before this batch. */
+        flushupdates(ifp);
+
+    if(buf->num_requests >= buf->max_requests) {
+        int n = buf->max_requests < 1 ? 16 : 2 * buf->max_requests;
+        struct buffered_request *new;
+        new = realloc(buf->requests, n * sizeof(struct buffered_request));
+        if(new == NULL) {
+            perror("realloc(requests)");
+            send_multihop_request(buf, ifp, prefix, plen, src_prefix, src_plen,
+                                  seqno, id, hop_count);
+            return;
+        }
+        buf->requests = new;
+        buf->max_requests = n;
+    }
+
+    b = &buf->requests[buf->num_requests];
+    memcpy(b->prefix, prefix, 16);
+    b->plen = plen;
+    memcpy(b->src_prefix, src_prefix, 16);
+    b->src_plen = src_plen;
+    memcpy(b->id, id, 8);
+    b->seqno = seqno;
+    b->hop_count = MIN(hop_count, 255);
+    b->order = buf->num_requests++;
+
+    /* A full packet's worth of requests, even the smallest ones. */
+    if(buf->num_requests * 16 >= buf->size)
+        flushrequests(buf, ifp);
+    else
+        schedule_flush(buf);
+}
+
+static int
+compare_request_prefixes(const void *av, const void *bv)
+{
+    const struct buffered_request *a = av, *b = bv;
+    int rc;
+
+    if(a->plen != b->plen)
+        return a->plen < b->plen ? -1 : 1;
+    rc = memcmp(a->prefix, b->prefix, 16);
+    if(rc != 0)
+        return rc;
+    if(a->src_plen != b->src_plen)
+        return a->src_plen < b->src_plen ? -1 : 1;
+    rc = memcmp(a->src_prefix, b->src_prefix, 16);
+    if(rc != 0)
+        return rc;
+    return a->order - b->order;
+}
+
+/* Starving routes first, then the requests that are easiest to satisfy. */
+static int
+compare_request_urgency(const void *av, const void *bv)
+{
+    const struct buffered_request *a = av, *b = bv;
+
+    if(a->urgent != b->urgent)
+        return a->urgent ? -1 : 1;
+    if(a->distance != b->distance)
+        return a->distance < b->distance ? -1 : 1;
+    return a->order - b->order;
+}
+
+static void
+flushrequests(struct buffered *buf, struct interface *ifp)
+{
+    struct buffered_request *b = buf->requests;
+    int n = buf->num_requests;
+    int i, j;
+
+    if(n == 0)
+        return;
+
+    /* Writing the requests may flush the buffer, which calls us again. */
+    buf->num_requests = 0;
+
+    qsort(b, n, sizeof(struct buffered_request), compare_request_prefixes);
+
+    j = 0;
+    for(i = 0; i < n; i++) {
+        if(j > 0 &&
+           b[j - 1].plen == b[i].plen &&
+           memcmp(b[j - 1].prefix, b[i].prefix, 16) == 0 &&
+           b[j - 1].src_plen == b[i].src_plen &&
+           memcmp(b[j - 1].src_prefix, b[i].src_prefix, 16) == 0) {
+            struct buffered_request *last = &b[j - 1];
+            if(memcmp(last->id, b[i].id, 8) != 0) {
+                *last = b[i];
+            } else {
+                if(seqno_compare(b[i].seqno, last->seqno) > 0)
+                    last->seqno = b[i].seqno;
+                last->hop_count = MAX(last->hop_count, b[i].hop_count);
+            }
+            continue;
+        }
+        b[j++] = b[i];
+    }
+    n = j;
+
+    for(i = 0; i < n; i++) {
+        struct babel_route *route;
+        struct source *src;
+        route = find_installed_route(b[i].prefix, b[i].plen,
+                                     b[i].src_prefix, b[i].src_plen);
+        b[i].urgent = route == NULL || route_metric(route) >= INFINITY;
+        src = find_source(b[i].id, b[i].prefix, b[i].plen,
+                          b[i].src_prefix, b[i].src_plen, 0, 0);
+        b[i].distance = src ? MAX(seqno_minus(b[i].seqno, src->seqno), 0) : 0;
+    }
+
+    qsort(b, n, sizeof(struct buffered_request), compare_request_urgency);
+
+    for(i = 0; i < n; i++)
+        send_multihop_request(buf, ifp, b[i].prefix, b[i].plen,
+                              b[i].src_prefix, b[i].src_plen,
+                              b[i].seqno, b[i].id, b[i].hop_count);
+}
+
 void
 send_multicast_multihop_request(struct interface *ifp,
                       const unsigned char *prefix, unsigned char plen,
@@ -2220,26 +2694,22 @@ send_multicast_multihop_request(struct interface *ifp,
         return;
     }
 
-    flushupdates(ifp);
-
     if(!if_up(ifp))
         return;
 
     if((ifp->flags & IF_UNICAST) != 0) {
             struct neighbour *neigh;
-            FOR_ALL_NEIGHBOURS(neigh) {
-                if(neigh->ifp == ifp) {
-                    send_multihop_request(&neigh->buf, neigh->ifp,
-                                          prefix, plen,
-                                          src_prefix, src_plen,
-                                          seqno, id, hop_count);
-                }
+            FOR_INTERFACE_NEIGHBOURS(neigh, ifp) {
+                buffer_request(&neigh->buf, neigh->ifp,
+                               prefix, plen,
+                               src_prefix, src_plen,
+                               seqno, id, hop_count);
             }
     } else {
-        send_multihop_request(&ifp->buf, ifp,
-                              prefix, plen,
-                              src_prefix, src_plen,
-                              seqno, id, hop_count);
+        buffer_request(&ifp->buf, ifp,
+                       prefix, plen,
+                       src_prefix, src_plen,
+                       seqno, id, hop_count);
     }
 
 }
@@ -2252,10 +2722,9 @@ send_unicast_multihop_request(struct neighbour *neigh,
                               unsigned short seqno, const unsigned char *id,
                               unsigned short hop_count)
 {
-    flushupdates(neigh->ifp);
-    send_multihop_request(&neigh->buf, neigh->ifp,
-                          prefix, plen, src_prefix, src_plen,
-                          seqno, id, hop_count);
+    buffer_request(&neigh->buf, neigh->ifp,
+                   prefix, plen, src_prefix, src_plen,
+                   seqno, id, hop_count);
 }
 
 /* Send a request to a well-chosen neighbour and resend.  If there is no
@@ -2274,14 +2743,14 @@ send_request_resend(const unsigned char *prefix, unsigned char plen,
         send_unicast_multihop_request(neigh, prefix, plen, src_prefix, src_plen,
                                       seqno, id, 127);
         record_resend(RESEND_REQUEST, prefix, plen, src_prefix, src_plen, seqno,
-                      id, neigh->ifp, resend_delay);
+                      id, neigh->ifp, neigh, resend_delay);
     } else {
         struct interface *ifp;
         FOR_ALL_INTERFACES(ifp) {
             if(!if_up(ifp)) continue;
-            send_multihop_request(&ifp->buf, ifp,
-                                  prefix, plen, src_prefix, src_plen,
-                                  seqno, id, 127);
+            buffer_request(&ifp->buf, ifp,
+                           prefix, plen, src_prefix, src_plen,
+                           seqno, id, 127);
         }
     }
 }
@@ -2356,5 +2825,5 @@ handle_request(struct neighbour *neigh, const unsigned char *prefix,
     send_unicast_multihop_request(successor, prefix, plen, src_prefix, src_plen,
                                   seqno, id, hop_count - 1);
     record_resend(RESEND_REQUEST, prefix, plen, src_prefix, src_plen, seqno, id,
-                  neigh->ifp, 0);
+                  neigh->ifp, neigh, 0);
 }
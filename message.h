@@ -62,10 +62,21 @@ extern int split_horizon;
 
 extern unsigned char packet_header[4];
 
+/* Where a TLV lies in a received packet. */
+struct tlv {
+    unsigned short offset;      /* from the start of the packet */
+    unsigned char type;
+    unsigned char len;          /* of the body, 0 for Pad1 */
+};
+
+extern struct buffered *pending_buffers;
+
 void parse_packet(const unsigned char *from, struct interface *ifp,
                   const unsigned char *packet, int packetlen,
-                  const unsigned char *to);
+                  const unsigned char *to, const struct timespec *stamp);
+void collect_tx_timestamps(void);
 void flushbuf(struct buffered *buf, struct interface *ifp);
+void discard_buffer(struct buffered *buf);
 void flushupdates(struct interface *ifp);
 int send_pc(struct buffered *buf, struct interface *ifp);
 void send_ack(struct neighbour *neigh, unsigned short nonce,
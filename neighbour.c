@@ -21,6 +21,7 @@ THE SOFTWARE.
 */
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <sys/time.h>
@@ -42,14 +43,75 @@ THE SOFTWARE.
 
 struct neighbour *neighs = NULL;
 
+/* Neighbours are indexed by a hash table keyed on (address, interface). */
+
+static struct neighbour **neighbour_buckets = NULL;
+static int num_neighbours = 0, num_neighbour_buckets = 0;
+
+static unsigned int
+neighbour_hash(const unsigned char *address, struct interface *ifp)
+{
+    /* FNV-1a */
+    unsigned int h = 2166136261U;
+    int i;
+
+    for(i = 0; i < 16; i++)
+        h = (h ^ address[i]) * 16777619U;
+    /* Not the ifindex, which may change under our feet. */
+    for(i = 0; i < (int)sizeof(uintptr_t); i++)
+        h = (h ^ (((uintptr_t)ifp >> (8 * i)) & 0xFF)) * 16777619U;
+    return h;
+}
+
+static struct neighbour **
+neighbour_bucket(const unsigned char *address, struct interface *ifp)
+{
+    unsigned int h = neighbour_hash(address, ifp);
+    return &neighbour_buckets[h & (num_neighbour_buckets - 1)];
+}
+
+static int
+resize_neighbour_buckets(int n)
+{
+    struct neighbour **buckets = neighbour_buckets;
+    int i, old = num_neighbour_buckets;
+
+    neighbour_buckets = calloc(n, sizeof(struct neighbour*));
+    if(neighbour_buckets == NULL) {
+        neighbour_buckets = buckets;
+        return -1;
+    }
+    num_neighbour_buckets = n;
+
+    for(i = 0; i < old; i++) {
+        struct neighbour *neigh = buckets[i], *next;
+        while(neigh) {
+            struct neighbour **bucket =
+                neighbour_bucket(neigh->address, neigh->ifp);
+            next = neigh->hash_next;
+            neigh->hash_next = *bucket;
+            *bucket = neigh;
+            neigh = next;
+        }
+    }
+    free(buckets);
+    return 1;
+}
+
 static struct neighbour *
 find_neighbour_nocreate(const unsigned char *address, struct interface *ifp)
 {
     struct neighbour *neigh;
-    FOR_ALL_NEIGHBOURS(neigh) {
+
+    if(num_neighbour_buckets == 0)
+        return NULL;
+
+    neigh = *neighbour_bucket(address, ifp);
+    while(neigh) {
         if(memcmp(address, neigh->address, 16) == 0 &&
            neigh->ifp == ifp)
             return neigh;
+        neigh = neigh->hash_next;
     }
     return NULL;
 }
@@ -57,6 +119,8 @@ find_neighbour_nocreate(const unsigned char *address, struct interface *ifp)
 static void
 flush_neighbour(struct neighbour *neigh)
 {
+    struct neighbour **p;
+
     flush_neighbour_routes(neigh);
     flush_resends(neigh);
 
@@ -68,17 +132,29 @@ flush_neighbour(struct neighbour *neigh)
             previous = previous->next;
         previous->next = neigh->next;
     }
+
+    p = neighbour_bucket(neigh->address, neigh->ifp);
+    while(*p != neigh)
+        p = &(*p)->hash_next;
+    *p = neigh->hash_next;
+    num_neighbours--;
+
+    if(neigh->if_prev)
+        neigh->if_prev->if_next = neigh->if_next;
+    else
+        neigh->ifp->neighs = neigh->if_next;
+    if(neigh->if_next)
+        neigh->if_next->if_prev = neigh->if_prev;
     local_notify_neighbour(neigh, LOCAL_FLUSH);
-    free(neigh->buf.buf);
+    discard_buffer(&neigh->buf);
     free(neigh);
 }
 
 struct neighbour *
 find_neighbour(const unsigned char *address, struct interface *ifp)
 {
-    struct neighbour *neigh;
+    struct neighbour *neigh, **bucket;
     const struct timeval zero = {0, 0};
-    unsigned char *buf;
 
     neigh = find_neighbour_nocreate(address, ifp);
     if(neigh)
@@ -87,15 +163,17 @@ find_neighbour(const unsigned char *address, struct interface *ifp)
     debugf("Creating neighbour %s on %s.\n",
            format_address(address), ifp->name);
 
-    buf = malloc(ifp->buf.size);
-    if(buf == NULL) {
-        perror("malloc(neighbour->buf)");
-        return NULL;
+    if(num_neighbours >= num_neighbour_buckets) {
+        resize_neighbour_buckets(num_neighbour_buckets < 1 ?
+                                 16 : 2 * num_neighbour_buckets);
+        if(num_neighbour_buckets == 0) {
+            perror("malloc(neighbour buckets)");
+            return NULL;
+        }
     }
 
     neigh = calloc(1, sizeof(struct neighbour));
     if(neigh == NULL) {
-        free(buf);
         perror("malloc(neighbour)");
         return NULL;
     }
@@ -113,7 +191,10 @@ find_neighbour(const unsigned char *address, struct interface *ifp)
     neigh->challenge_request_limitation = zero;
     neigh->challenge_reply_limitation = zero;
     neigh->ifp = ifp;
-    neigh->buf.buf = buf;
+    /* The send buffer is only allocated when something is queued. */
+    neigh->buf.buf = NULL;
+    neigh->buf.lazy = 1;
+    neigh->buf.ifp = ifp;
     neigh->buf.size = ifp->buf.size;
     neigh->buf.hello = -1;
     neigh->buf.flush_interval = ifp->buf.flush_interval;
@@ -123,6 +204,15 @@ find_neighbour(const unsigned char *address, struct interface *ifp)
     neigh->buf.sin6.sin6_scope_id = ifp->ifindex;
     neigh->next = neighs;
     neighs = neigh;
+    bucket = neighbour_bucket(address, ifp);
+    neigh->hash_next = *bucket;
+    *bucket = neigh;
+    num_neighbours++;
+    neigh->if_prev = NULL;
+    neigh->if_next = ifp->neighs;
+    if(neigh->if_next)
+        neigh->if_next->if_prev = neigh;
+    ifp->neighs = neigh;
     local_notify_neighbour(neigh, LOCAL_ADD);
     return neigh;
 }
@@ -31,6 +31,8 @@ struct hello_history {
 
 struct neighbour {
     struct neighbour *next;
+    struct neighbour *hash_next;            /* in the same hash bucket */
+    struct neighbour *if_next, *if_prev;    /* on the same interface */
     /* This is -1 when unknown, so don't make it unsigned */
     unsigned char address[16];
     struct hello_history hello;
@@ -56,6 +58,9 @@ struct neighbour {
     struct timeval challenge_reply_limitation;
     struct interface *ifp;
     struct buffered buf;
+    struct babel_route *routes; /* routes through this neighbour */
+    struct nexthop *nexthops;   /* interned nexthops other than address */
+    struct resend *resends;     /* resends caused by this neighbour */
 };
 
 extern struct neighbour *neighs;
@@ -63,6 +68,9 @@ extern struct neighbour *neighs;
 #define FOR_ALL_NEIGHBOURS(_neigh) \
     for(_neigh = neighs; _neigh; _neigh = _neigh->next)
 
+#define FOR_INTERFACE_NEIGHBOURS(_neigh, _ifp) \
+    for(_neigh = (_ifp)->neighs; _neigh; _neigh = _neigh->if_next)
+
 struct neighbour *find_neighbour(const unsigned char *address,
                                  struct interface *ifp);
 int update_neighbour(struct neighbour *neigh, struct hello_history *hist,
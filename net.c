@@ -36,11 +36,25 @@ THE SOFTWARE.
 #include <netinet/ip.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#if defined(SO_TIMESTAMPNS) && defined(SO_TIMESTAMPING)
+#define HAVE_TIMESTAMPING
+#endif
+#endif
 
 #include "babeld.h"
 #include "util.h"
 #include "net.h"
 
+/* Whether the kernel accepts per-packet requests for transmit
+   timestamps on the protocol socket. */
+static int tx_timestamping = 0;
+
 int
 babel_socket(int port)
 {
@@ -90,6 +104,21 @@ babel_socket(int port)
     if(rc < 0)
         goto fail;
 
+#ifdef HAVE_TIMESTAMPING
+    rc = setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+    if(rc < 0)
+        perror("Couldn't enable receive timestamps");
+
+    {
+        unsigned int flags = SOF_TIMESTAMPING_SOFTWARE |
+            SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+        rc = setsockopt(s, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+        if(rc < 0)
+            perror("Couldn't enable transmit timestamps");
+        tx_timestamping = rc >= 0;
+    }
+#endif
+
     rc = fcntl(s, F_GETFL, 0);
     if(rc < 0)
         goto fail;
@@ -122,16 +151,48 @@ babel_socket(int port)
     return -1;
 }
 
+#define RECV_CMSG_SIZE 256
+
+/* Extract the destination address and the receive timestamp of a
+   packet.  Returns 0 if there was no destination. */
+static int
+parse_recv_cmsg(struct msghdr *msg, unsigned char *src_return,
+                struct timespec *stamp_return)
+{
+    struct cmsghdr *cmsg;
+    int found = 0;
+
+    if(stamp_return != NULL)
+        memset(stamp_return, 0, sizeof(*stamp_return));
+    cmsg = CMSG_FIRSTHDR(msg);
+    while(cmsg != NULL) {
+        if(cmsg->cmsg_level == IPPROTO_IPV6 &&
+           cmsg->cmsg_type == IPV6_PKTINFO) {
+            struct in6_pktinfo *info =(struct in6_pktinfo*)CMSG_DATA(cmsg);
+            if(src_return != NULL)
+                memcpy(src_return, info->ipi6_addr.s6_addr, 16);
+            found = 1;
+        }
+#ifdef HAVE_TIMESTAMPING
+        if(cmsg->cmsg_level == SOL_SOCKET &&
+           cmsg->cmsg_type == SCM_TIMESTAMPNS && stamp_return != NULL)
+            memcpy(stamp_return, CMSG_DATA(cmsg), sizeof(*stamp_return));
+#endif
+        cmsg = CMSG_NXTHDR(msg, cmsg);
+    }
+    return found;
+}
+
+/* If stamp_return is not NULL, it is set to the time at which the kernel
+   received the packet, on the realtime clock, or zeroed if unknown. */
 int
 babel_recv(int s, void *buf, int buflen, struct sockaddr *sin, int slen,
-           unsigned char *src_return)
+           unsigned char *src_return, struct timespec *stamp_return)
 {
     struct iovec iovec;
     struct msghdr msg;
-    unsigned char cmsgbuf[128];
-    struct cmsghdr *cmsg;
-    int rc, found;
-    unsigned char src[16] = {0};
+    unsigned char cmsgbuf[RECV_CMSG_SIZE];
+    int rc;
 
     memset(&msg, 0, sizeof(msg));
     iovec.iov_base = buf;
@@ -147,38 +208,156 @@ babel_recv(int s, void *buf, int buflen, struct sockaddr *sin, int slen,
     if(rc < 0)
         return rc;
 
-    found = 0;
-    memset(src, 0, 16);
+    if(!parse_recv_cmsg(&msg, src_return, stamp_return)) {
+        errno = EDESTADDRREQ;
+        return -1;
+    }
+    return rc;
+}
+
+/* Receive up to n packets in one go.  Returns the number of packets
+   received, or -1 with errno set; packets without a destination address
+   have their len set to -1. */
+int
+babel_recv_batch(int s, struct received_packet *packets, int n)
+{
+#ifdef __linux__
+    static struct mmsghdr *msgs = NULL;
+    static struct iovec *iovecs = NULL;
+    static unsigned char *cmsgbufs = NULL;
+    static int max_msgs = 0;
+    int i, rc;
+
+    if(n > max_msgs) {
+        struct mmsghdr *new_msgs;
+        struct iovec *new_iovecs;
+        unsigned char *new_cmsgbufs;
+        new_msgs = realloc(msgs, n * sizeof(struct mmsghdr));
+        if(new_msgs == NULL)
+            return -1;
+        msgs = new_msgs;
+        new_iovecs = realloc(iovecs, n * sizeof(struct iovec));
+        if(new_iovecs == NULL)
+            return -1;
+        iovecs = new_iovecs;
+        new_cmsgbufs = realloc(cmsgbufs, n * RECV_CMSG_SIZE);
+        if(new_cmsgbufs == NULL)
+            return -1;
+        cmsgbufs = new_cmsgbufs;
+        max_msgs = n;
+    }
+
+    memset(msgs, 0, n * sizeof(struct mmsghdr));
+    for(i = 0; i < n; i++) {
+        struct msghdr *msg = &msgs[i].msg_hdr;
+        iovecs[i].iov_base = packets[i].buf;
+        iovecs[i].iov_len = packets[i].buflen;
+        msg->msg_name = &packets[i].sin6;
+        msg->msg_namelen = sizeof(packets[i].sin6);
+        msg->msg_iov = &iovecs[i];
+        msg->msg_iovlen = 1;
+        msg->msg_control = cmsgbufs + i * RECV_CMSG_SIZE;
+        msg->msg_controllen = RECV_CMSG_SIZE;
+    }
+
+    rc = recvmmsg(s, msgs, n, 0, NULL);
+    if(rc <= 0)
+        return rc;
+
+    for(i = 0; i < rc; i++) {
+        packets[i].len = msgs[i].msg_len;
+        if(!parse_recv_cmsg(&msgs[i].msg_hdr, packets[i].to,
+                            &packets[i].stamp))
+            packets[i].len = -1;
+    }
+    return rc;
+#else
+    int rc;
+
+    rc = babel_recv(s, packets[0].buf, packets[0].buflen,
+                    (struct sockaddr*)&packets[0].sin6,
+                    sizeof(packets[0].sin6),
+                    packets[0].to, &packets[0].stamp);
+    if(rc < 0) {
+        if(errno != EDESTADDRREQ)
+            return rc;
+        rc = -1;
+    }
+    packets[0].len = rc;
+    return 1;
+#endif
+}
+
+/* Read one transmit timestamp from the socket's error queue.  Returns 1
+   and sets key_return to the kernel's count of timestamped packets sent
+   before this one, 0 if the message was something else, and -1 with
+   errno set to EAGAIN if the queue is empty. */
+int
+babel_recv_tx_timestamp(int s, unsigned int *key_return,
+                        struct timespec *stamp_return)
+{
+#ifdef HAVE_TIMESTAMPING
+    struct iovec iovec;
+    struct msghdr msg;
+    unsigned char data[64];
+    unsigned char cmsgbuf[256];
+    struct cmsghdr *cmsg;
+    int rc, have_key = 0, have_stamp = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    iovec.iov_base = data;
+    iovec.iov_len = sizeof(data);
+    msg.msg_iov = &iovec;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsgbuf;
+    msg.msg_controllen = sizeof(cmsgbuf);
+
+    rc = recvmsg(s, &msg, MSG_ERRQUEUE);
+    if(rc < 0)
+        return rc;
+
     cmsg = CMSG_FIRSTHDR(&msg);
     while(cmsg != NULL) {
-        if(cmsg->cmsg_level == IPPROTO_IPV6 &&
-           cmsg->cmsg_type == IPV6_PKTINFO) {
-            struct in6_pktinfo *info =(struct in6_pktinfo*)CMSG_DATA(cmsg);
-            memcpy(src, info->ipi6_addr.s6_addr, 16);
-            found = 1;
-            break;
+        if(cmsg->cmsg_level == SOL_SOCKET &&
+           cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            struct scm_timestamping tss;
+            memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
+            *stamp_return = tss.ts[0];
+            have_stamp = stamp_return->tv_sec != 0;
+        } else if(cmsg->cmsg_level == IPPROTO_IPV6 &&
+                  cmsg->cmsg_type == IPV6_RECVERR) {
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if(err.ee_errno == ENOMSG &&
+               err.ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+                *key_return = err.ee_data;
+                have_key = 1;
+            }
         }
         cmsg = CMSG_NXTHDR(&msg, cmsg);
     }
 
-    if(!found) {
-        errno = EDESTADDRREQ;
-        return -1;
-    }
-    if(src_return != NULL)
-        memcpy(src_return, src, 16);
-    return rc;
+    return have_key && have_stamp;
+#else
+    errno = EAGAIN;
+    return -1;
+#endif
 }
 
+/* If *tx_timestamp is true, ask the kernel for a transmit timestamp, to
+   be read with babel_recv_tx_timestamp; *tx_timestamp is cleared if that
+   is not possible. */
 int
 babel_send(int s,
            const void *buf1, int buflen1, const void *buf2, int buflen2,
-           const struct sockaddr *sin, int slen, int dontfrag)
+           const struct sockaddr *sin, int slen, int dontfrag,
+           int *tx_timestamp)
 {
     struct iovec iovec[2];
     struct msghdr msg;
     int one = 1;
-    unsigned char cmsgbuf[CMSG_SPACE(sizeof(one))];
+    unsigned char cmsgbuf[CMSG_SPACE(sizeof(one)) +
+                          CMSG_SPACE(sizeof(unsigned int))];
     int rc, count = 0;
 
     iovec[0].iov_base = (void*)buf1;
@@ -190,16 +369,34 @@ babel_send(int s,
     msg.msg_namelen = slen;
     msg.msg_iov = iovec;
     msg.msg_iovlen = 2;
-    if(dontfrag) {
+    if(tx_timestamp != NULL && !tx_timestamping)
+        *tx_timestamp = 0;
+    if(dontfrag || (tx_timestamp != NULL && *tx_timestamp)) {
         struct cmsghdr *cmsg;
+        int len = 0;
+        memset(cmsgbuf, 0, sizeof(cmsgbuf));
         msg.msg_control = cmsgbuf;
         msg.msg_controllen = sizeof(cmsgbuf);
         cmsg = CMSG_FIRSTHDR(&msg);
-        cmsg->cmsg_level = IPPROTO_IPV6;
-        cmsg->cmsg_type = IPV6_DONTFRAG;;
-        cmsg->cmsg_len = CMSG_LEN(sizeof(one));
-        memcpy(CMSG_DATA(cmsg), &one, sizeof(one));
-        msg.msg_controllen = cmsg->cmsg_len;
+        if(dontfrag) {
+            cmsg->cmsg_level = IPPROTO_IPV6;
+            cmsg->cmsg_type = IPV6_DONTFRAG;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(one));
+            memcpy(CMSG_DATA(cmsg), &one, sizeof(one));
+            len += CMSG_SPACE(sizeof(one));
+            cmsg = CMSG_NXTHDR(&msg, cmsg);
+        }
+#ifdef HAVE_TIMESTAMPING
+        if(tx_timestamp != NULL && *tx_timestamp) {
+            unsigned int flags = SOF_TIMESTAMPING_TX_SOFTWARE;
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SO_TIMESTAMPING;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(flags));
+            memcpy(CMSG_DATA(cmsg), &flags, sizeof(flags));
+            len += CMSG_SPACE(sizeof(flags));
+        }
+#endif
+        msg.msg_controllen = len;
     }
 
     /* The Linux kernel can apparently keep returning EAGAIN indefinitely. */
@@ -220,6 +417,12 @@ babel_send(int s,
                     goto again;
             }
             errno = EAGAIN;
+        } else if(errno == EINVAL && tx_timestamp != NULL && *tx_timestamp) {
+            /* Kernel too old for per-packet timestamping requests. */
+            tx_timestamping = 0;
+            *tx_timestamp = 0;
+            return babel_send(s, buf1, buflen1, buf2, buflen2, sin, slen,
+                              dontfrag, NULL);
         }
     }
     return rc;
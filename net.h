@@ -20,11 +20,25 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
+/* A slot in the ring of receive buffers. */
+struct received_packet {
+    unsigned char *buf;
+    int buflen;
+    int len;
+    struct sockaddr_in6 sin6;
+    unsigned char to[16];
+    struct timespec stamp;
+};
+
 int babel_socket(int port);
 int babel_recv(int s, void *buf, int buflen, struct sockaddr *sin, int slen,
-               unsigned char *src_return);
+               unsigned char *src_return, struct timespec *stamp_return);
+int babel_recv_batch(int s, struct received_packet *packets, int n);
+int babel_recv_tx_timestamp(int s, unsigned int *key_return,
+                            struct timespec *stamp_return);
 int babel_send(int s,
                const void *buf1, int buflen1, const void *buf2, int buflen2,
-               const struct sockaddr *sin, int slen, int dontfrag);
+               const struct sockaddr *sin, int slen, int dontfrag,
+               int *tx_timestamp);
 int tcp_server_socket(int port, int local);
 int unix_server_socket(const char *path);
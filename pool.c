@@ -0,0 +1,199 @@
+/*
+Copyright (c) 2026 by the babeld authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "pool.h"
+
+struct pool_slab {
+    struct pool *pool;
+    struct pool_slab *next, *prev;
+    void *free;                 /* singly-linked through the objects */
+    int used;
+    int capacity;
+};
+
+#define OBJECT_ALIGN 16
+#define SLAB_HEADER \
+    ((sizeof(struct pool_slab) + OBJECT_ALIGN - 1) & ~(OBJECT_ALIGN - 1))
+
+struct pool *pools = NULL;
+
+static size_t
+object_size(struct pool *pool)
+{
+    size_t size = pool->size < sizeof(void*) ? sizeof(void*) : pool->size;
+    return (size + OBJECT_ALIGN - 1) & ~(OBJECT_ALIGN - 1);
+}
+
+static void
+slab_unlink(struct pool_slab **list, struct pool_slab *slab)
+{
+    if(slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+    if(slab->next)
+        slab->next->prev = slab->prev;
+    slab->next = slab->prev = NULL;
+}
+
+static void
+slab_link(struct pool_slab **list, struct pool_slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = *list;
+    if(*list)
+        (*list)->prev = slab;
+    *list = slab;
+}
+
+static struct pool_slab *
+new_slab(struct pool *pool)
+{
+    struct pool_slab *slab;
+    size_t size = object_size(pool);
+    unsigned char *p;
+    void *mem;
+    int i, rc;
+
+    assert(SLAB_HEADER <= POOL_SLAB_HEADER);
+    assert(SLAB_HEADER + size <= POOL_SLAB_SIZE);
+
+    rc = posix_memalign(&mem, POOL_SLAB_SIZE, POOL_SLAB_SIZE);
+    if(rc != 0) {
+        /* posix_memalign doesn't set errno. */
+        errno = rc;
+        return NULL;
+    }
+
+    slab = mem;
+    slab->pool = pool;
+    slab->next = slab->prev = NULL;
+    slab->used = 0;
+    slab->capacity = (POOL_SLAB_SIZE - SLAB_HEADER) / size;
+    slab->free = NULL;
+
+    p = (unsigned char*)mem + SLAB_HEADER;
+    for(i = slab->capacity - 1; i >= 0; i--) {
+        void **object = (void**)(p + i * size);
+        *object = slab->free;
+        slab->free = object;
+    }
+
+    pool->slabs++;
+    pool->free += slab->capacity;
+    return slab;
+}
+
+/* Returns a zeroed object, or NULL with errno set. */
+void *
+pool_alloc(struct pool *pool)
+{
+    struct pool_slab *slab;
+    void *object;
+
+    if(!pool->registered) {
+        pool->next = pools;
+        pools = pool;
+        pool->registered = 1;
+    }
+
+    slab = pool->partial;
+    if(slab == NULL) {
+        slab = new_slab(pool);
+        if(slab == NULL)
+            return NULL;
+        slab_link(&pool->partial, slab);
+    }
+
+    object = slab->free;
+    slab->free = *(void**)object;
+    slab->used++;
+    if(slab->free == NULL) {
+        slab_unlink(&pool->partial, slab);
+        slab_link(&pool->full, slab);
+    }
+
+    pool->live++;
+    pool->free--;
+    if(pool->live > pool->high_water)
+        pool->high_water = pool->live;
+
+    memset(object, 0, pool->size);
+    return object;
+}
+
+void
+pool_free(struct pool *pool, void *object)
+{
+    struct pool_slab *slab;
+
+    if(object == NULL)
+        return;
+
+    slab = (struct pool_slab*)((uintptr_t)object & ~(POOL_SLAB_SIZE - 1));
+    assert(slab->pool == pool);
+    assert(slab->used > 0);
+
+    if(slab->free == NULL) {
+        slab_unlink(&pool->full, slab);
+        slab_link(&pool->partial, slab);
+    }
+    *(void**)object = slab->free;
+    slab->free = object;
+    slab->used--;
+
+    pool->live--;
+    pool->free++;
+}
+
+/* Give empty slabs back to the system, keeping one per pool to avoid
+   thrashing. */
+void
+trim_pools(void)
+{
+    struct pool *pool;
+
+    FOR_ALL_POOLS(pool) {
+        struct pool_slab *slab = pool->partial, *next;
+        int kept = 0;
+        while(slab) {
+            next = slab->next;
+            if(slab->used == 0) {
+                if(kept) {
+                    slab_unlink(&pool->partial, slab);
+                    pool->free -= slab->capacity;
+                    pool->slabs--;
+                    free(slab);
+                } else {
+                    kept = 1;
+                }
+            }
+            slab = next;
+        }
+    }
+}
@@ -0,0 +1,54 @@
+/*
+Copyright (c) 2026 by the babeld authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Fixed-size object pools.  Objects are carved out of aligned slabs, so
+   that the slab owning an object can be found by masking its address. */
+
+#define POOL_SLAB_SIZE 16384
+#define POOL_SLAB_HEADER 64     /* upper bound on the slab header */
+
+/* The largest object size of which n fit in a single slab. */
+#define POOL_FIT(n) (((POOL_SLAB_SIZE - POOL_SLAB_HEADER) / (n)) & ~15)
+
+struct pool_slab;
+
+struct pool {
+    const char *name;
+    size_t size;
+    struct pool_slab *partial;  /* slabs with at least one free object */
+    struct pool_slab *full;
+    int live, free, high_water, slabs;
+    struct pool *next;          /* NULL until first used */
+    int registered;
+};
+
+#define POOL_INITIALIZER(_name, _size) \
+    { (_name), (_size), NULL, NULL, 0, 0, 0, 0, NULL, 0 }
+
+extern struct pool *pools;
+
+#define FOR_ALL_POOLS(_pool) \
+    for(_pool = pools; _pool; _pool = _pool->next)
+
+void *pool_alloc(struct pool *pool);
+void pool_free(struct pool *pool, void *object);
+void trim_pools(void);
@@ -24,6 +24,7 @@ THE SOFTWARE.
 #include <time.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
@@ -34,9 +35,222 @@ THE SOFTWARE.
 #include "resend.h"
 #include "message.h"
 #include "configuration.h"
+#include "route.h"
+#include "pool.h"
 
 struct timeval resend_time = {0, 0};
-struct resend *to_resend = NULL;
+
+/* Retransmissions moved to a new successor, or dropped, when the
+   neighbour that caused them went away, and requests that were due on
+   an interface with no neighbours left. */
+unsigned int resends_retargeted = 0, resends_dropped = 0, resends_wasted = 0;
+
+static struct pool resend_pool =
+    POOL_INITIALIZER("resend", sizeof(struct resend));
+
+/* Resends are indexed by a hash table keyed on (kind, prefix, src_prefix),
+   and those that are scheduled are kept in a heap ordered by deadline. */
+
+static struct resend **resend_buckets = NULL;
+static int num_resends = 0, num_resend_buckets = 0;
+
+static struct resend **resend_heap = NULL;
+static int resend_heap_len = 0, resend_heap_max = 0;
+
+static unsigned int
+resend_hash(int kind, const unsigned char *prefix, unsigned char plen,
+            const unsigned char *src_prefix, unsigned char src_plen)
+{
+    /* FNV-1a */
+    unsigned int h = 2166136261U;
+    int i;
+
+    h = (h ^ kind) * 16777619U;
+    for(i = 0; i < 16; i++)
+        h = (h ^ prefix[i]) * 16777619U;
+    h = (h ^ plen) * 16777619U;
+    for(i = 0; i < 16; i++)
+        h = (h ^ src_prefix[i]) * 16777619U;
+    h = (h ^ src_plen) * 16777619U;
+    return h;
+}
+
+static struct resend **
+resend_bucket(int kind, const unsigned char *prefix, unsigned char plen,
+              const unsigned char *src_prefix, unsigned char src_plen)
+{
+    unsigned int h = resend_hash(kind, prefix, plen, src_prefix, src_plen);
+    return &resend_buckets[h & (num_resend_buckets - 1)];
+}
+
+static int
+resize_resend_buckets(int n)
+{
+    struct resend **buckets = resend_buckets;
+    int i, old = num_resend_buckets;
+
+    resend_buckets = calloc(n, sizeof(struct resend*));
+    if(resend_buckets == NULL) {
+        resend_buckets = buckets;
+        return -1;
+    }
+    num_resend_buckets = n;
+
+    for(i = 0; i < old; i++) {
+        struct resend *resend = buckets[i], *next;
+        while(resend) {
+            struct resend **bucket =
+                resend_bucket(resend->kind, resend->prefix, resend->plen,
+                              resend->src_prefix, resend->src_plen);
+            next = resend->next;
+            resend->next = *bucket;
+            *bucket = resend;
+            resend = next;
+        }
+    }
+    free(buckets);
+    return 1;
+}
+
+static int
+resend_before(const struct resend *a, const struct resend *b)
+{
+    return timeval_compare(&a->deadline, &b->deadline) < 0;
+}
+
+static void
+heap_set(int i, struct resend *resend)
+{
+    resend_heap[i] = resend;
+    resend->heap_index = i;
+}
+
+static void
+heap_up(int i)
+{
+    struct resend *resend = resend_heap[i];
+    while(i > 0) {
+        int parent = (i - 1) / 2;
+        if(!resend_before(resend, resend_heap[parent]))
+            break;
+        heap_set(i, resend_heap[parent]);
+        i = parent;
+    }
+    heap_set(i, resend);
+}
+
+static void
+heap_down(int i)
+{
+    struct resend *resend = resend_heap[i];
+    while(1) {
+        int child = 2 * i + 1;
+        if(child >= resend_heap_len)
+            break;
+        if(child + 1 < resend_heap_len &&
+           resend_before(resend_heap[child + 1], resend_heap[child]))
+            child++;
+        if(!resend_before(resend_heap[child], resend))
+            break;
+        heap_set(i, resend_heap[child]);
+        i = child;
+    }
+    heap_set(i, resend);
+}
+
+static void
+unschedule_resend(struct resend *resend)
+{
+    int i = resend->heap_index;
+
+    if(i < 0)
+        return;
+
+    resend->heap_index = -1;
+    resend_heap_len--;
+    if(i < resend_heap_len) {
+        heap_set(i, resend_heap[resend_heap_len]);
+        heap_up(i);
+        heap_down(resend_heap[i]->heap_index);
+    }
+}
+
+static int resend_expired(struct resend *resend);
+
+/* Put resend in the heap, or update its position, according to its
+   current time and delay. */
+static void
+schedule_resend(struct resend *resend)
+{
+    if(resend_expired(resend) || resend->delay == 0 || resend->max == 0) {
+        unschedule_resend(resend);
+        return;
+    }
+
+    timeval_add_msec(&resend->deadline, &resend->time, resend->delay);
+
+    if(resend->heap_index < 0) {
+        if(resend_heap_len >= resend_heap_max) {
+            struct resend **new_heap;
+            int n = resend_heap_max < 1 ? 16 : 2 * resend_heap_max;
+            new_heap = realloc(resend_heap, n * sizeof(struct resend*));
+            if(new_heap == NULL) {
+                perror("realloc(resend_heap)");
+                return;
+            }
+            resend_heap = new_heap;
+            resend_heap_max = n;
+        }
+        heap_set(resend_heap_len++, resend);
+        heap_up(resend_heap_len - 1);
+    } else {
+        heap_up(resend->heap_index);
+        heap_down(resend->heap_index);
+    }
+}
+
+/* Attribute resend to neigh, which may be NULL. */
+static void
+attribute_resend(struct resend *resend, struct neighbour *neigh)
+{
+    if(resend->neigh == neigh)
+        return;
+
+    if(resend->neigh) {
+        if(resend->neigh_prev)
+            resend->neigh_prev->neigh_next = resend->neigh_next;
+        else
+            resend->neigh->resends = resend->neigh_next;
+        if(resend->neigh_next)
+            resend->neigh_next->neigh_prev = resend->neigh_prev;
+    }
+
+    resend->neigh = neigh;
+    resend->neigh_prev = NULL;
+    resend->neigh_next = NULL;
+    if(neigh) {
+        resend->neigh_next = neigh->resends;
+        if(resend->neigh_next)
+            resend->neigh_next->neigh_prev = resend;
+        neigh->resends = resend;
+    }
+}
+
+static void
+free_resend(struct resend *resend)
+{
+    struct resend **p = resend_bucket(resend->kind, resend->prefix,
+                                      resend->plen, resend->src_prefix,
+                                      resend->src_plen);
+
+    unschedule_resend(resend);
+    attribute_resend(resend, NULL);
+    while(*p != resend)
+        p = &(*p)->next;
+    *p = resend->next;
+    num_resends--;
+    pool_free(&resend_pool, resend);
+}
 
 static int
 resend_match(struct resend *resend,
@@ -49,30 +263,75 @@ resend_match(struct resend *resend,
             memcmp(resend->src_prefix, src_prefix, 16) == 0);
 }
 
-/* This is called by neigh.c when a neighbour is flushed */
+/* Whether anyone other than neigh is listening on ifp, or anywhere if
+   ifp is NULL. */
+static int
+other_neighbour(struct interface *ifp, struct neighbour *neigh)
+{
+    struct neighbour *n;
+
+    if(ifp == NULL) {
+        FOR_ALL_NEIGHBOURS(n) {
+            if(n != neigh)
+                return 1;
+        }
+        return 0;
+    }
+
+    FOR_INTERFACE_NEIGHBOURS(n, ifp) {
+        if(n != neigh)
+            return 1;
+    }
+    return 0;
+}
+
+/* This is called by neigh.c when a neighbour is flushed, after its
+   routes.  Pending retransmissions are moved to the new successor if
+   there is one, and dropped otherwise; forwarded requests are kept only
+   as long as somebody else might be interested in the reply. */
 
 void
 flush_resends(struct neighbour *neigh)
 {
-    /* Nothing for now */
+    while(neigh->resends) {
+        struct resend *resend = neigh->resends;
+
+        attribute_resend(resend, NULL);
+
+        if(resend->heap_index >= 0) {
+            struct babel_route *route =
+                find_best_route(resend->prefix, resend->plen,
+                                resend->src_prefix, resend->src_plen,
+                                0, neigh);
+            if(route) {
+                attribute_resend(resend, route->neigh);
+                resend->ifp = route->neigh->ifp;
+                resends_retargeted += resend->max;
+                continue;
+            }
+            resends_dropped += resend->max;
+        } else if(other_neighbour(resend->ifp, neigh)) {
+            continue;
+        }
+
+        free_resend(resend);
+    }
+    recompute_resend_time();
 }
 
 static struct resend *
 find_resend(int kind, const unsigned char *prefix, unsigned char plen,
-            const unsigned char *src_prefix, unsigned char src_plen,
-            struct resend **previous_return)
+            const unsigned char *src_prefix, unsigned char src_plen)
 {
-    struct resend *current, *previous;
+    struct resend *current;
+
+    if(num_resend_buckets == 0)
+        return NULL;
 
-    previous = NULL;
-    current = to_resend;
+    current = *resend_bucket(kind, prefix, plen, src_prefix, src_plen);
     while(current) {
-        if(resend_match(current, kind, prefix, plen, src_prefix, src_plen)) {
-            if(previous_return)
-                *previous_return = previous;
+        if(resend_match(current, kind, prefix, plen, src_prefix, src_plen))
             return current;
-        }
-        previous = current;
         current = current->next;
     }
 
@@ -81,18 +340,16 @@ find_resend(int kind, const unsigned char *prefix, unsigned char plen,
 
 static struct resend *
 find_request(const unsigned char *prefix, unsigned char plen,
-             const unsigned char *src_prefix, unsigned char src_plen,
-             struct resend **previous_return)
+             const unsigned char *src_prefix, unsigned char src_plen)
 {
-    return find_resend(RESEND_REQUEST, prefix, plen, src_prefix, src_plen,
-                       previous_return);
+    return find_resend(RESEND_REQUEST, prefix, plen, src_prefix, src_plen);
 }
 
 int
 record_resend(int kind, const unsigned char *prefix, unsigned char plen,
               const unsigned char *src_prefix, unsigned char src_plen,
               unsigned short seqno, const unsigned char *id,
-              struct interface *ifp, int delay)
+              struct interface *ifp, struct neighbour *neigh, int delay)
 {
     struct resend *resend;
     unsigned int ifindex = ifp ? ifp->ifindex : 0;
@@ -109,7 +366,7 @@ record_resend(int kind, const unsigned char *prefix, unsigned char plen,
     if(delay >= 0xFFFF)
         delay = 0xFFFF;
 
-    resend = find_resend(kind, prefix, plen, src_prefix, src_plen, NULL);
+    resend = find_resend(kind, prefix, plen, src_prefix, src_plen);
     if(resend) {
         if(resend->delay && delay)
             resend->delay = MIN(resend->delay, delay);
@@ -119,6 +376,8 @@ record_resend(int kind, const unsigned char *prefix, unsigned char plen,
         resend->max = RESEND_MAX;
         if(id && memcmp(resend->id, id, 8) == 0 &&
            seqno_compare(resend->seqno, seqno) > 0) {
+            schedule_resend(resend);
+            recompute_resend_time();
             return 0;
         }
         if(id)
@@ -128,8 +387,16 @@ record_resend(int kind, const unsigned char *prefix, unsigned char plen,
         resend->seqno = seqno;
         if(resend->ifp != ifp)
             resend->ifp = NULL;
+        if(resend->neigh != neigh)
+            attribute_resend(resend, NULL);
     } else {
-        resend = calloc(1, sizeof(struct resend));
+        struct resend **bucket;
+        if(num_resends >= num_resend_buckets)
+            resize_resend_buckets(num_resend_buckets < 1 ?
+                                  64 : 2 * num_resend_buckets);
+        if(num_resend_buckets == 0)
+            return -1;
+        resend = pool_alloc(&resend_pool);
         if(resend == NULL)
             return -1;
         resend->kind = kind;
@@ -143,16 +410,18 @@ record_resend(int kind, const unsigned char *prefix, unsigned char plen,
         if(id)
             memcpy(resend->id, id, 8);
         resend->ifp = ifp;
+        resend->neigh = NULL;
+        attribute_resend(resend, neigh);
         resend->time = now;
-        resend->next = to_resend;
-        to_resend = resend;
+        resend->heap_index = -1;
+        bucket = resend_bucket(kind, prefix, plen, src_prefix, src_plen);
+        resend->next = *bucket;
+        *bucket = resend;
+        num_resends++;
     }
 
-    if(resend->delay) {
-        struct timeval timeout;
-        timeval_add_msec(&timeout, &resend->time, resend->delay);
-        timeval_min(&resend_time, &timeout);
-    }
+    schedule_resend(resend);
+    recompute_resend_time();
     return 1;
 }
 
@@ -174,7 +443,7 @@ unsatisfied_request(const unsigned char *prefix, unsigned char plen,
 {
     struct resend *request;
 
-    request = find_request(prefix, plen, src_prefix, src_plen, NULL);
+    request = find_request(prefix, plen, src_prefix, src_plen);
     if(request == NULL || resend_expired(request))
         return 0;
 
@@ -194,7 +463,7 @@ request_redundant(struct interface *ifp,
 {
     struct resend *request;
 
-    request = find_request(prefix, plen, src_prefix, src_plen, NULL);
+    request = find_request(prefix, plen, src_prefix, src_plen);
     if(request == NULL || resend_expired(request))
         return 0;
 
@@ -223,9 +492,9 @@ satisfy_request(const unsigned char *prefix, unsigned char plen,
                 unsigned short seqno, const unsigned char *id,
                 struct interface *ifp)
 {
-    struct resend *request, *previous;
+    struct resend *request;
 
-    request = find_request(prefix, plen, src_prefix, src_plen, &previous);
+    request = find_request(prefix, plen, src_prefix, src_plen);
     if(request == NULL)
         return 0;
 
@@ -238,6 +507,7 @@ satisfy_request(const unsigned char *prefix, unsigned char plen,
            now.  Mark it as expired, so that expire_resend will remove it. */
         request->max = 0;
         request->time.tv_sec = 0;
+        unschedule_resend(request);
         recompute_resend_time();
         return 1;
     }
@@ -248,83 +518,64 @@ satisfy_request(const unsigned char *prefix, unsigned char plen,
 void
 expire_resend()
 {
-    struct resend *current, *previous;
-    int recompute = 0;
-
-    previous = NULL;
-    current = to_resend;
-    while(current) {
-        if(resend_expired(current)) {
-            if(previous == NULL) {
-                to_resend = current->next;
-                free(current);
-                current = to_resend;
-            } else {
-                previous->next = current->next;
-                free(current);
-                current = previous->next;
-            }
-            recompute = 1;
-        } else {
-            previous = current;
-            current = current->next;
+    int i;
+
+    for(i = 0; i < num_resend_buckets; i++) {
+        struct resend *current = resend_buckets[i], *next;
+        while(current) {
+            next = current->next;
+            if(resend_expired(current))
+                free_resend(current);
+            current = next;
         }
     }
-    if(recompute)
-        recompute_resend_time();
+    recompute_resend_time();
 }
 
 void
 recompute_resend_time()
 {
-    struct resend *request;
-    struct timeval resend = {0, 0};
-
-    request = to_resend;
-    while(request) {
-        if(!resend_expired(request) && request->delay > 0 && request->max > 0) {
-            struct timeval timeout;
-            timeval_add_msec(&timeout, &request->time, request->delay);
-            timeval_min(&resend, &timeout);
-        }
-        request = request->next;
-    }
-
-    resend_time = resend;
+    if(resend_heap_len > 0)
+        resend_time = resend_heap[0]->deadline;
+    else
+        resend_time = (struct timeval){0, 0};
 }
 
 void
 do_resend()
 {
-    struct resend *resend;
+    while(resend_heap_len > 0 &&
+          timeval_compare(&now, &resend_heap[0]->deadline) >= 0) {
+        struct resend *resend = resend_heap[0];
+
+        if(resend_expired(resend)) {
+            unschedule_resend(resend);
+            continue;
+        }
 
-    resend = to_resend;
-    while(resend) {
-        if(!resend_expired(resend) && resend->delay > 0 && resend->max > 0) {
-            struct timeval timeout;
-            timeval_add_msec(&timeout, &resend->time, resend->delay);
-            if(timeval_compare(&now, &timeout) >= 0) {
-                switch(resend->kind) {
-                case RESEND_REQUEST:
-                    send_multicast_multihop_request(resend->ifp,
-                                                    resend->prefix, resend->plen,
-                                                    resend->src_prefix,
-                                                    resend->src_plen,
-                                                    resend->seqno, resend->id,
-                                                    127);
-                    break;
-                case RESEND_UPDATE:
-                    send_update(resend->ifp, 1,
-                                resend->prefix, resend->plen,
-                                resend->src_prefix, resend->src_plen);
-                    break;
-                default: abort();
-                }
-                resend->delay = MIN(0xFFFF, resend->delay * 2);
-                resend->max--;
+        switch(resend->kind) {
+        case RESEND_REQUEST:
+            if(!other_neighbour(resend->ifp, NULL)) {
+                resends_wasted++;
+                break;
             }
+            send_multicast_multihop_request(resend->ifp,
+                                            resend->prefix, resend->plen,
+                                            resend->src_prefix,
+                                            resend->src_plen,
+                                            resend->seqno, resend->id,
+                                            127);
+            break;
+        case RESEND_UPDATE:
+            send_update(resend->ifp, 1,
+                        resend->prefix, resend->plen,
+                        resend->src_prefix, resend->src_plen);
+            break;
+        default: abort();
         }
-        resend = resend->next;
+        resend->delay = MIN(0xFFFF, resend->delay * 2);
+        resend->max--;
+        schedule_resend(resend);
     }
     recompute_resend_time();
 }
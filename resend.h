@@ -38,16 +38,21 @@ struct resend {
     unsigned short seqno;
     unsigned char id[8];
     struct interface *ifp;
-    struct resend *next;
+    struct neighbour *neigh;    /* the neighbour that caused this, if any */
+    struct resend *neigh_next, *neigh_prev;
+    struct resend *next;        /* in the same hash bucket */
+    struct timeval deadline;    /* time + delay, when scheduled */
+    int heap_index;             /* -1 if not scheduled */
 };
 
 extern struct timeval resend_time;
+extern unsigned int resends_retargeted, resends_dropped, resends_wasted;
 
 void flush_resends(struct neighbour *neigh);
 int record_resend(int kind, const unsigned char *prefix, unsigned char plen,
                   const unsigned char *src_prefix, unsigned char src_plen,
                   unsigned short seqno, const unsigned char *id,
-                  struct interface *ifp, int delay);
+                  struct interface *ifp, struct neighbour *neigh, int delay);
 int unsatisfied_request(const unsigned char *prefix, unsigned char plen,
                         const unsigned char *src_prefix, unsigned char src_plen,
                         unsigned short seqno, const unsigned char *id);
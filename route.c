@@ -39,19 +39,76 @@ THE SOFTWARE.
 #include "resend.h"
 #include "configuration.h"
 #include "local.h"
+#include "pool.h"
 
-struct babel_route **routes = NULL;
-static int route_slots = 0, max_route_slots = 0;
 int kernel_metric = 0, reflect_kernel_metric = 0;
 int allow_duplicates = -1;
 int diversity_factor = 256;     /* in units of 1/256 */
+int multipath_tolerance = -1;
+int damping_half_life = 0;      /* in seconds, 0 disables damping */
+int damping_suppress = 2000, damping_reuse = 750;
+
+#define DAMPING_PENALTY_WITHDRAW 1000
+#define DAMPING_PENALTY_CHANGE 500
 
 static int smoothing_half_life = 0;
 static int two_to_the_one_over_hl = 0; /* 2^(1/hl) * 0x10000 */
+/* 2^(-2^i/hl) * 0x10000, used to decay the smoothed metric in closed form. */
+#define SMOOTHING_DECAY_BITS 32
+static unsigned int smoothing_decay[SMOOTHING_DECAY_BITS];
+
+/* We maintain a balanced (AVL) tree of "slots", ordered by prefix.  Every
+   slot contains a linked list of the routes to this prefix, with the
+   installed route, if any, at the head of the list.  A slot is never
+   empty, so the head route is used as the slot's key.
+
+   Each slot also caches the result of find_best_route, indexed by the
+   feasible flag.  Smoothed metrics and expiry only change from one second
+   to the next, so the cache is valid for the current second.  Within a
+   second, update_best_route keeps it up to date as route metrics change,
+   and only a route that gets worse while it is the best one, or a source
+   change, forces a rescan. */
+
+#define MAX_MULTIPATH 16
+
+struct multipath_member {
+    struct babel_route *route;
+    int weight;
+};
+
+struct route_slot {
+    struct babel_route *routes;
+    struct route_slot *left, *right, *parent;
+    int height;
+    struct babel_route *best[2];
+    unsigned short best_metric[2];
+    unsigned int best_time;
+    int best_valid;             /* bitmap indexed by feasible */
+    /* Members of the kernel route, if it is a multipath route. */
+    struct multipath_member *multipath;
+    int multipath_len;
+    /* Flap damping state. */
+    unsigned int penalty;
+    unsigned int penalty_time;
+    unsigned int flaps;
+    int suppressed;
+};
 
-/* We maintain a list of "slots", ordered by prefix.  Every slot
-   contains a linked list of the routes to this prefix, with the
-   installed route, if any, at the head of the list. */
+static struct route_slot *route_root = NULL;
+static int route_slots = 0;
+
+static struct pool route_pool =
+    POOL_INITIALIZER("route", sizeof(struct babel_route));
+static struct pool slot_pool =
+    POOL_INITIALIZER("route-slot", sizeof(struct route_slot));
+
+static void cancel_route_update(struct babel_route *route);
+static void collapse_multipath(struct route_slot *slot);
+static void update_multipath(struct route_slot *slot);
+static void update_best_route(struct babel_route *route);
+static void forget_multipath_member(struct route_slot *slot,
+                                    struct babel_route *route);
+static void free_multipath(struct route_slot *slot);
 
 static int
 route_compare(const unsigned char *prefix, unsigned char plen,
@@ -91,39 +148,196 @@ route_compare(const unsigned char *prefix, unsigned char plen,
     return 0;
 }
 
-/* Performs binary search, returns -1 in case of failure.  In the latter
-   case, new_return is the place where to insert the new element. */
+/* Returns NULL in case of failure.  In the latter case, parent_return
+   is the slot under which the new slot should be inserted, and
+   dir_return the side (negative for left). */
 
-static int
+static struct route_slot *
 find_route_slot(const unsigned char *prefix, unsigned char plen,
                 const unsigned char *src_prefix, unsigned char src_plen,
-                int *new_return)
+                struct route_slot **parent_return, int *dir_return)
 {
-    int p, m, g, c;
+    struct route_slot *slot = route_root, *parent = NULL;
+    int c = 0;
 
-    if(route_slots < 1) {
-        if(new_return)
-            *new_return = 0;
-        return -1;
+    while(slot) {
+        c = route_compare(prefix, plen, src_prefix, src_plen, slot->routes);
+        if(c == 0)
+            return slot;
+        parent = slot;
+        slot = c < 0 ? slot->left : slot->right;
     }
 
-    p = 0; g = route_slots - 1;
+    if(parent_return)
+        *parent_return = parent;
+    if(dir_return)
+        *dir_return = c;
 
-    do {
-        m = (p + g) / 2;
-        c = route_compare(prefix, plen, src_prefix, src_plen, routes[m]);
-        if(c == 0)
-            return m;
-        else if(c < 0)
-            g = m - 1;
-        else
-            p = m + 1;
-    } while(p <= g);
+    return NULL;
+}
 
-    if(new_return)
-        *new_return = p;
+static struct route_slot *
+first_route_slot(void)
+{
+    struct route_slot *slot = route_root;
 
-    return -1;
+    if(slot == NULL)
+        return NULL;
+    while(slot->left)
+        slot = slot->left;
+    return slot;
+}
+
+static struct route_slot *
+next_route_slot(struct route_slot *slot)
+{
+    if(slot->right) {
+        slot = slot->right;
+        while(slot->left)
+            slot = slot->left;
+        return slot;
+    }
+
+    while(slot->parent && slot->parent->right == slot)
+        slot = slot->parent;
+    return slot->parent;
+}
+
+static int
+slot_height(struct route_slot *slot)
+{
+    return slot ? slot->height : 0;
+}
+
+static void
+slot_update_height(struct route_slot *slot)
+{
+    slot->height = MAX(slot_height(slot->left), slot_height(slot->right)) + 1;
+}
+
+static void
+slot_replace_child(struct route_slot *parent,
+                   struct route_slot *old, struct route_slot *new)
+{
+    if(parent == NULL)
+        route_root = new;
+    else if(parent->left == old)
+        parent->left = new;
+    else
+        parent->right = new;
+}
+
+static struct route_slot *
+slot_rotate_left(struct route_slot *x)
+{
+    struct route_slot *y = x->right;
+
+    x->right = y->left;
+    if(y->left)
+        y->left->parent = x;
+    y->parent = x->parent;
+    slot_replace_child(x->parent, x, y);
+    y->left = x;
+    x->parent = y;
+    slot_update_height(x);
+    slot_update_height(y);
+    return y;
+}
+
+static struct route_slot *
+slot_rotate_right(struct route_slot *x)
+{
+    struct route_slot *y = x->left;
+
+    x->left = y->right;
+    if(y->right)
+        y->right->parent = x;
+    y->parent = x->parent;
+    slot_replace_child(x->parent, x, y);
+    y->right = x;
+    x->parent = y;
+    slot_update_height(x);
+    slot_update_height(y);
+    return y;
+}
+
+/* Restore the AVL invariant on the path from slot to the root. */
+static void
+rebalance_route_slots(struct route_slot *slot)
+{
+    while(slot) {
+        int balance = slot_height(slot->left) - slot_height(slot->right);
+        if(balance > 1) {
+            if(slot_height(slot->left->left) < slot_height(slot->left->right))
+                slot_rotate_left(slot->left);
+            slot = slot_rotate_right(slot);
+        } else if(balance < -1) {
+            if(slot_height(slot->right->right) <
+               slot_height(slot->right->left))
+                slot_rotate_right(slot->right);
+            slot = slot_rotate_left(slot);
+        } else {
+            slot_update_height(slot);
+        }
+        slot = slot->parent;
+    }
+}
+
+static void
+invalidate_slot(struct route_slot *slot)
+{
+    slot->best_valid = 0;
+}
+
+/* Called whenever something that find_best_route depends on changes in
+   the slot of src, other than a single route. */
+void
+invalidate_best_route(const struct source *src)
+{
+    struct route_slot *slot =
+        find_route_slot(src->prefix, src->plen, src->src_prefix, src->src_plen,
+                        NULL, NULL);
+    if(slot)
+        invalidate_slot(slot);
+}
+
+static void
+remove_route_slot(struct route_slot *slot)
+{
+    struct route_slot *rebalance;
+
+    if(slot->left == NULL || slot->right == NULL) {
+        struct route_slot *child = slot->left ? slot->left : slot->right;
+        if(child)
+            child->parent = slot->parent;
+        slot_replace_child(slot->parent, slot, child);
+        rebalance = slot->parent;
+    } else {
+        /* Splice the successor into our position. */
+        struct route_slot *succ = slot->right;
+        while(succ->left)
+            succ = succ->left;
+        if(succ->parent != slot) {
+            rebalance = succ->parent;
+            succ->parent->left = succ->right;
+            if(succ->right)
+                succ->right->parent = succ->parent;
+            succ->right = slot->right;
+            slot->right->parent = succ;
+        } else {
+            rebalance = succ;
+        }
+        succ->left = slot->left;
+        slot->left->parent = succ;
+        succ->parent = slot->parent;
+        slot_replace_child(slot->parent, slot, succ);
+        succ->height = slot->height;
+    }
+
+    rebalance_route_slots(rebalance);
+    route_slots--;
+    free_multipath(slot);
+    pool_free(&slot_pool, slot);
 }
 
 struct babel_route *
@@ -132,12 +346,13 @@ find_route(const unsigned char *prefix, unsigned char plen,
            struct neighbour *neigh)
 {
     struct babel_route *route;
-    int i = find_route_slot(prefix, plen, src_prefix, src_plen, NULL);
+    struct route_slot *slot =
+        find_route_slot(prefix, plen, src_prefix, src_plen, NULL, NULL);
 
-    if(i < 0)
+    if(slot == NULL)
         return NULL;
 
-    route = routes[i];
+    route = slot->routes;
 
     while(route) {
         if(route->neigh == neigh)
@@ -152,10 +367,11 @@ struct babel_route *
 find_installed_route(const unsigned char *prefix, unsigned char plen,
                      const unsigned char *src_prefix, unsigned char src_plen)
 {
-    int i = find_route_slot(prefix, plen, src_prefix, src_plen, NULL);
+    struct route_slot *slot =
+        find_route_slot(prefix, plen, src_prefix, src_plen, NULL, NULL);
 
-    if(i >= 0 && routes[i]->installed)
-        return routes[i];
+    if(slot && slot->routes->installed)
+        return slot->routes;
 
     return NULL;
 }
@@ -167,71 +383,130 @@ installed_routes_estimate(void)
     return route_slots;
 }
 
-static int
-resize_route_table(int new_slots)
-{
-    struct babel_route **new_routes;
-    assert(new_slots >= route_slots);
-
-    if(new_slots == 0) {
-        new_routes = NULL;
-        free(routes);
-    } else {
-        new_routes = realloc(routes, new_slots * sizeof(struct babel_route*));
-        if(new_routes == NULL)
-            return -1;
-    }
-
-    max_route_slots = new_slots;
-    routes = new_routes;
-    return 1;
-}
-
 /* Insert a route into the table.  If successful, retains the route.
    On failure, caller must free the route. */
 static struct babel_route *
 insert_route(struct babel_route *route)
 {
-    int i, n;
+    struct route_slot *slot, *parent;
+    int dir;
 
     assert(!route->installed);
 
-    i = find_route_slot(route->src->prefix, route->src->plen,
-                        route->src->src_prefix, route->src->src_plen, &n);
+    slot = find_route_slot(route->src->prefix, route->src->plen,
+                           route->src->src_prefix, route->src->src_plen,
+                           &parent, &dir);
 
-    if(i < 0) {
-        if(route_slots >= max_route_slots)
-            resize_route_table(max_route_slots < 1 ? 8 : 2 * max_route_slots);
-        if(route_slots >= max_route_slots)
+    if(slot == NULL) {
+        slot = pool_alloc(&slot_pool);
+        if(slot == NULL)
             return NULL;
         route->next = NULL;
-        if(n < route_slots)
-            memmove(routes + n + 1, routes + n,
-                    (route_slots - n) * sizeof(struct babel_route*));
+        slot->routes = route;
+        slot->height = 1;
+        slot->parent = parent;
+        if(parent == NULL)
+            route_root = slot;
+        else if(dir < 0)
+            parent->left = slot;
+        else
+            parent->right = slot;
         route_slots++;
-        routes[n] = route;
+        rebalance_route_slots(parent);
     } else {
         struct babel_route *r;
-        r = routes[i];
+        r = slot->routes;
         while(r->next)
             r = r->next;
         r->next = route;
         route->next = NULL;
     }
 
+    invalidate_slot(slot);
+
+    /* Also link the route into its neighbour's list. */
+    route->neigh_prev = NULL;
+    route->neigh_next = route->neigh->routes;
+    if(route->neigh_next)
+        route->neigh_next->neigh_prev = route;
+    route->neigh->routes = route;
+
     return route;
 }
 
+static void
+unlink_neighbour_route(struct babel_route *route)
+{
+    if(route->neigh_prev)
+        route->neigh_prev->neigh_next = route->neigh_next;
+    else
+        route->neigh->routes = route->neigh_next;
+    if(route->neigh_next)
+        route->neigh_next->neigh_prev = route->neigh_prev;
+    route->neigh_next = route->neigh_prev = NULL;
+}
+
+/* Most routes use the neighbour's address as their nexthop; others
+   share a refcounted copy kept by the neighbour. */
+static const unsigned char *
+intern_nexthop(struct neighbour *neigh, const unsigned char *nexthop)
+{
+    struct nexthop *nh;
+
+    if(memcmp(nexthop, neigh->address, 16) == 0)
+        return neigh->address;
+
+    for(nh = neigh->nexthops; nh; nh = nh->next) {
+        if(memcmp(nexthop, nh->address, 16) == 0) {
+            nh->refcount++;
+            return nh->address;
+        }
+    }
+
+    nh = malloc(sizeof(struct nexthop));
+    if(nh == NULL)
+        return NULL;
+    memcpy(nh->address, nexthop, 16);
+    nh->refcount = 1;
+    nh->next = neigh->nexthops;
+    neigh->nexthops = nh;
+    return nh->address;
+}
+
+static void
+release_nexthop(struct neighbour *neigh, const unsigned char *nexthop)
+{
+    struct nexthop *nh, *previous = NULL;
+
+    if(nexthop == NULL || nexthop == neigh->address)
+        return;
+
+    for(nh = neigh->nexthops; nh; previous = nh, nh = nh->next) {
+        if(nh->address == nexthop) {
+            if(--nh->refcount == 0) {
+                if(previous)
+                    previous->next = nh->next;
+                else
+                    neigh->nexthops = nh->next;
+                free(nh);
+            }
+            return;
+        }
+    }
+    assert(0);
+}
+
 static void
 destroy_route(struct babel_route *route)
 {
-    free(route);
+    release_nexthop(route->neigh, route->nexthop);
+    pool_free(&route_pool, route);
 }
 
 void
 flush_route(struct babel_route *route)
 {
-    int i;
+    struct route_slot *slot;
     struct source *src;
     unsigned oldmetric;
     int lost = 0;
@@ -244,37 +519,34 @@ flush_route(struct babel_route *route)
         lost = 1;
     }
 
-    i = find_route_slot(route->src->prefix, route->src->plen,
-                        route->src->src_prefix, route->src->src_plen, NULL);
-    assert(i >= 0 && i < route_slots);
+    slot = find_route_slot(route->src->prefix, route->src->plen,
+                           route->src->src_prefix, route->src->src_plen,
+                           NULL, NULL);
+    assert(slot != NULL);
 
     local_notify_route(route, LOCAL_FLUSH);
 
-    if(route == routes[i]) {
-        routes[i] = route->next;
+    unlink_neighbour_route(route);
+    invalidate_slot(slot);
+    if(route->pending)
+        cancel_route_update(route);
+    forget_multipath_member(slot, route);
+
+    if(route == slot->routes) {
+        slot->routes = route->next;
         route->next = NULL;
         destroy_route(route);
 
-        if(routes[i] == NULL) {
-            if(i < route_slots - 1)
-                memmove(routes + i, routes + i + 1,
-                        (route_slots - i - 1) * sizeof(struct babel_route*));
-            routes[route_slots - 1] = NULL;
-            route_slots--;
-            VALGRIND_MAKE_MEM_UNDEFINED(routes + route_slots, sizeof(struct babel_route *));
-        }
-
-        if(route_slots == 0)
-            resize_route_table(0);
-        else if(max_route_slots > 8 && route_slots < max_route_slots / 4)
-            resize_route_table(max_route_slots / 2);
+        if(slot->routes == NULL)
+            remove_route_slot(slot);
     } else {
-        struct babel_route *r = routes[i];
+        struct babel_route *r = slot->routes;
         while(r->next != route)
             r = r->next;
         r->next = route->next;
         route->next = NULL;
         destroy_route(route);
+        update_multipath(slot);
     }
 
     if(lost)
@@ -286,18 +558,12 @@ flush_route(struct babel_route *route)
 void
 flush_all_routes()
 {
-    int i;
-
-    /* Start from the end, to avoid shifting the table. */
-    i = route_slots - 1;
-    while(i >= 0) {
-        while(i < route_slots) {
-            /* Uninstall first, to avoid calling route_lost. */
-            if(routes[i]->installed)
-                uninstall_route(routes[i]);
-            flush_route(routes[i]);
-        }
-        i--;
+    while(route_root) {
+        struct babel_route *route = route_root->routes;
+        /* Uninstall first, to avoid calling route_lost. */
+        if(route->installed)
+            uninstall_route(route);
+        flush_route(route);
     }
 
     check_sources_released();
@@ -306,51 +572,30 @@ flush_all_routes()
 void
 flush_neighbour_routes(struct neighbour *neigh)
 {
-    int i;
-
-    i = 0;
-    while(i < route_slots) {
-        struct babel_route *r;
-        r = routes[i];
-        while(r) {
-            if(r->neigh == neigh) {
-                flush_route(r);
-                goto again;
-            }
-            r = r->next;
-        }
-        i++;
-    again:
-        ;
-    }
+    while(neigh->routes)
+        flush_route(neigh->routes);
 }
 
 void
 flush_interface_routes(struct interface *ifp, int v4only)
 {
-    int i;
+    struct neighbour *neigh;
 
-    i = 0;
-    while(i < route_slots) {
-        struct babel_route *r;
-        r = routes[i];
+    FOR_INTERFACE_NEIGHBOURS(neigh, ifp) {
+        struct babel_route *r, *next;
+        r = neigh->routes;
         while(r) {
-            if(r->neigh->ifp == ifp &&
-               (!v4only || v4mapped(r->nexthop))) {
+            next = r->neigh_next;
+            if(!v4only || v4mapped(r->nexthop))
                 flush_route(r);
-                goto again;
-            }
-            r = r->next;
+            r = next;
         }
-        i++;
-    again:
-        ;
     }
 }
 
 struct route_stream {
     int installed;
-    int index;
+    struct route_slot *slot;
     struct babel_route *next;
 };
 
@@ -365,8 +610,8 @@ route_stream(int installed)
         return NULL;
 
     stream->installed = installed;
-    stream->index = installed ? 0 : -1;
-    stream->next = NULL;
+    stream->slot = first_route_slot();
+    stream->next = stream->slot ? stream->slot->routes : NULL;
 
     return stream;
 }
@@ -375,26 +620,28 @@ struct babel_route *
 route_stream_next(struct route_stream *stream)
 {
     if(stream->installed) {
-        while(stream->index < route_slots) {
-            if(routes[stream->index]->installed)
+        struct babel_route *next;
+        while(stream->slot) {
+            if(stream->slot->routes->installed)
                 break;
             else
-                stream->index++;
+                stream->slot = next_route_slot(stream->slot);
         }
-        if(stream->index < route_slots)
-            return routes[stream->index++];
-        else
+        if(stream->slot == NULL)
             return NULL;
+        next = stream->slot->routes;
+        stream->slot = next_route_slot(stream->slot);
+        return next;
     } else {
-        struct babel_route *next;
-        if(!stream->next) {
-            stream->index++;
-            if(stream->index >= route_slots)
-                return NULL;
-            stream->next = routes[stream->index];
-        }
-        next = stream->next;
+        struct babel_route *next = stream->next;
+        if(next == NULL)
+            return NULL;
         stream->next = next->next;
+        if(stream->next == NULL) {
+            stream->slot = next_route_slot(stream->slot);
+            if(stream->slot)
+                stream->next = stream->slot->routes;
+        }
         return next;
     }
 }
@@ -421,18 +668,18 @@ metric_to_kernel(int metric)
 /* This is used to maintain the invariant that the installed route is at
    the head of the list. */
 static void
-move_installed_route(struct babel_route *route, int i)
+move_installed_route(struct babel_route *route, struct route_slot *slot)
 {
-    assert(i >= 0 && i < route_slots);
+    assert(slot != NULL);
     assert(route->installed);
 
-    if(route != routes[i]) {
-        struct babel_route *r = routes[i];
+    if(route != slot->routes) {
+        struct babel_route *r = slot->routes;
         while(r->next != route)
             r = r->next;
         r->next = route->next;
-        route->next = routes[i];
-        routes[i] = route;
+        route->next = slot->routes;
+        slot->routes = route;
     }
 }
 
@@ -467,7 +714,8 @@ change_route(int operation, const struct babel_route *route, int metric,
 void
 install_route(struct babel_route *route)
 {
-    int i, rc;
+    struct route_slot *slot;
+    int rc;
 
     if(route->installed)
         return;
@@ -476,11 +724,12 @@ install_route(struct babel_route *route)
         fprintf(stderr, "WARNING: installing unfeasible route "
                 "(this shouldn't happen).");
 
-    i = find_route_slot(route->src->prefix, route->src->plen,
-                        route->src->src_prefix, route->src->src_plen, NULL);
-    assert(i >= 0 && i < route_slots);
+    slot = find_route_slot(route->src->prefix, route->src->plen,
+                           route->src->src_prefix, route->src->src_plen,
+                           NULL, NULL);
+    assert(slot != NULL);
 
-    if(routes[i] != route && routes[i]->installed) {
+    if(slot->routes != route && slot->routes->installed) {
         fprintf(stderr, "WARNING: attempting to install duplicate route "
                 "(this shouldn't happen).");
         return;
@@ -497,9 +746,10 @@ install_route(struct babel_route *route)
     }
 
     route->installed = 1;
-    move_installed_route(route, i);
+    move_installed_route(route, slot);
 
     local_notify_route(route, LOCAL_CHANGE);
+    update_multipath(slot);
 }
 
 void
@@ -510,6 +760,13 @@ uninstall_route(struct babel_route *route)
     if(!route->installed)
         return;
 
+    if(multipath_tolerance >= 0)
+        collapse_multipath(find_route_slot(route->src->prefix,
+                                           route->src->plen,
+                                           route->src->src_prefix,
+                                           route->src->src_plen,
+                                           NULL, NULL));
+
     route->installed = 0;
 
     debugf("uninstall_route(%s from %s)\n",
@@ -531,6 +788,7 @@ uninstall_route(struct babel_route *route)
 static void
 switch_routes(struct babel_route *old, struct babel_route *new)
 {
+    struct route_slot *slot;
     int rc;
 
     if(!old) {
@@ -545,6 +803,11 @@ switch_routes(struct babel_route *old, struct babel_route *new)
         fprintf(stderr, "WARNING: switching to unfeasible route "
                 "(this shouldn't happen).");
 
+    slot = find_route_slot(new->src->prefix, new->src->plen,
+                           new->src->src_prefix, new->src->src_plen,
+                           NULL, NULL);
+    collapse_multipath(slot);
+
     debugf("switch_routes(%s from %s)\n",
            format_prefix(old->src->prefix, old->src->plen),
            format_prefix(old->src->src_prefix, old->src->src_plen));
@@ -558,12 +821,10 @@ switch_routes(struct babel_route *old, struct babel_route *new)
 
     old->installed = 0;
     new->installed = 1;
-    move_installed_route(new, find_route_slot(new->src->prefix, new->src->plen,
-                                              new->src->src_prefix,
-                                              new->src->src_plen,
-                                              NULL));
+    move_installed_route(new, slot);
     local_notify_route(old, LOCAL_CHANGE);
     local_notify_route(new, LOCAL_CHANGE);
+    update_multipath(slot);
 }
 
 static void
@@ -575,6 +836,12 @@ change_route_metric(struct babel_route *route,
 
     if(route->installed && old_metric != new_metric) {
         int rc;
+        if(multipath_tolerance >= 0)
+            collapse_multipath(find_route_slot(route->src->prefix,
+                                               route->src->plen,
+                                               route->src->src_prefix,
+                                               route->src->src_plen,
+                                               NULL, NULL));
         debugf("change_route_metric(%s from %s, %d -> %d)\n",
                format_prefix(route->src->prefix, route->src->plen),
                format_prefix(route->src->src_prefix, route->src->src_plen),
@@ -593,6 +860,12 @@ change_route_metric(struct babel_route *route,
     route->refmetric = refmetric;
     route->cost = cost;
     route->add_metric = add;
+    update_best_route(route);
+    if(multipath_tolerance >= 0)
+        update_multipath(find_route_slot(route->src->prefix, route->src->plen,
+                                         route->src->src_prefix,
+                                         route->src->src_plen,
+                                         NULL, NULL));
 
     if(smoothing_half_life == 0) {
         route->smoothed_metric = route_metric(route);
@@ -628,6 +901,283 @@ route_expired(struct babel_route *route)
     return route->time < now.tv_sec - route->hold_time;
 }
 
+/* With multipath enabled, the kernel route of a slot may carry, besides
+   the installed route, every feasible route whose metric is within
+   multipath_tolerance of the installed one.  Members are weighted in
+   inverse proportion to their metric.  The installed route is the one
+   that we announce, and it is always a member. */
+
+static int
+change_multipath(const struct babel_route *route,
+                 const struct multipath_member *members, int n)
+{
+    struct filter_result filter_result;
+    struct kernel_nexthop nexthops[MAX_MULTIPATH];
+    int i, m, table;
+
+    m = install_filter(route->src->prefix, route->src->plen,
+                       route->src->src_prefix, route->src->src_plen,
+                       route->neigh->ifp->ifindex, &filter_result);
+    if(m >= INFINITY) {
+        errno = EPERM;
+        return -1;
+    }
+    table = filter_result.table ? filter_result.table : export_table;
+
+    for(i = 0; i < n; i++) {
+        nexthops[i].gate = members[i].route->nexthop;
+        nexthops[i].ifindex = members[i].route->neigh->ifp->ifindex;
+        nexthops[i].weight = members[i].weight;
+    }
+
+    return kernel_route_multipath(ROUTE_ADD, table,
+                                  route->src->prefix, route->src->plen,
+                                  route->src->src_prefix, route->src->src_plen,
+                                  filter_result.pref_src, nexthops, n,
+                                  metric_to_kernel(route_metric(route)));
+}
+
+static void
+free_multipath(struct route_slot *slot)
+{
+    free(slot->multipath);
+    slot->multipath = NULL;
+    slot->multipath_len = 0;
+}
+
+/* Reduce the kernel route to the installed route alone.  This must be
+   called before the installed route is modified in the kernel. */
+static void
+collapse_multipath(struct route_slot *slot)
+{
+    struct multipath_member single;
+    int rc;
+
+    if(slot->multipath_len == 0)
+        return;
+
+    assert(slot->routes->installed);
+    single.route = slot->routes;
+    single.weight = 1;
+    rc = change_multipath(slot->routes, &single, 1);
+    if(rc < 0)
+        perror("kernel_route(multipath collapse)");
+    free_multipath(slot);
+}
+
+static int
+multipath_weight(int best, int metric)
+{
+    return MAX(1, (16 * (best + 1) + (metric + 1) / 2) / (metric + 1));
+}
+
+/* Recompute the members of the kernel route of slot, and reinstall it if
+   they changed. */
+static void
+update_multipath(struct route_slot *slot)
+{
+    struct babel_route *installed = slot->routes, *r;
+    struct multipath_member members[MAX_MULTIPATH], *new;
+    int n = 0, best, i, j, rc;
+
+    if(multipath_tolerance < 0 || !installed->installed)
+        return;
+
+    best = route_metric(installed);
+    if(best >= INFINITY) {
+        collapse_multipath(slot);
+        return;
+    }
+
+    members[n++].route = installed;
+    for(r = installed->next; r && n < MAX_MULTIPATH; r = r->next) {
+        int metric = route_metric(r);
+        if(metric >= INFINITY ||
+           metric > route_metric(installed) + multipath_tolerance ||
+           route_expired(r) || !route_feasible(r) ||
+           v4mapped(r->nexthop) != v4mapped(installed->nexthop))
+            continue;
+        members[n++].route = r;
+        best = MIN(best, metric);
+    }
+
+    if(n == 1) {
+        collapse_multipath(slot);
+        return;
+    }
+
+    for(i = 0; i < n; i++)
+        members[i].weight = multipath_weight(best,
+                                             route_metric(members[i].route));
+
+    if(n == slot->multipath_len) {
+        for(i = 0; i < n; i++) {
+            for(j = 0; j < n; j++) {
+                if(slot->multipath[j].route == members[i].route &&
+                   slot->multipath[j].weight == members[i].weight)
+                    break;
+            }
+            if(j >= n)
+                break;
+        }
+        if(i >= n)
+            return;
+    }
+
+    new = malloc(n * sizeof(struct multipath_member));
+    if(new == NULL) {
+        perror("malloc(multipath)");
+        return;
+    }
+
+    debugf("update_multipath(%s from %s, %d nexthops)\n",
+           format_prefix(installed->src->prefix, installed->src->plen),
+           format_prefix(installed->src->src_prefix,
+                         installed->src->src_plen),
+           n);
+    rc = change_multipath(installed, members, n);
+    if(rc < 0) {
+        if(errno == ENOSYS) {
+            fprintf(stderr,
+                    "Multipath routes are not supported by this kernel, "
+                    "disabling multipath-tolerance.\n");
+            multipath_tolerance = -1;
+        } else {
+            perror("kernel_route(multipath)");
+        }
+        free(new);
+        return;
+    }
+
+    memcpy(new, members, n * sizeof(struct multipath_member));
+    free(slot->multipath);
+    slot->multipath = new;
+    slot->multipath_len = n;
+}
+
+/* Flap damping.  Every triggered update for a destination adds to the
+   penalty of its slot, which decays exponentially with a half-life of
+   damping_half_life seconds.  When the penalty reaches damping_suppress,
+   the slot is suppressed: we stop switching routes and sending
+   non-urgent triggered updates for it until the penalty has decayed below
+   damping_reuse.  Retractions and source changes are still sent
+   immediately, since they are needed to avoid blackholes and loops.
+   Only damp_slot and release_damped_slot modify the damping state of a
+   slot; the predicates below may be called from anywhere. */
+
+static unsigned int
+slot_penalty(const struct route_slot *slot)
+{
+    unsigned int penalty = slot->penalty;
+
+    if(penalty > 0 && slot->penalty_time < now.tv_sec) {
+        unsigned elapsed = now.tv_sec - slot->penalty_time;
+        unsigned halvings = elapsed / damping_half_life;
+        unsigned rest = elapsed % damping_half_life;
+        if(halvings >= 32) {
+            penalty = 0;
+        } else {
+            /* 2^-x is close enough to 1 - x/2 for x in [0, 1). */
+            penalty >>= halvings;
+            penalty -= (unsigned long long)penalty * rest /
+                (2 * damping_half_life);
+        }
+    }
+    return penalty;
+}
+
+/* Whether slot is still suppressed.  A slot whose penalty has decayed
+   stays marked until release_damped_slot catches up with it. */
+static int
+slot_suppressed(const struct route_slot *slot)
+{
+    if(!slot->suppressed)
+        return 0;
+
+    return damping_half_life > 0 && slot_penalty(slot) >= damping_reuse;
+}
+
+static void
+damp_slot(struct route_slot *slot, unsigned int penalty)
+{
+    if(damping_half_life <= 0)
+        return;
+
+    slot->penalty = MIN(slot_penalty(slot) + penalty, 4 * damping_suppress);
+    slot->penalty_time = now.tv_sec;
+    slot->flaps++;
+    if(!slot->suppressed && slot->penalty >= damping_suppress) {
+        debugf("Suppressing %s from %s (penalty %u).\n",
+               format_prefix(slot->routes->src->prefix,
+                             slot->routes->src->plen),
+               format_prefix(slot->routes->src->src_prefix,
+                             slot->routes->src->src_plen),
+               slot->penalty);
+        slot->suppressed = 1;
+    }
+}
+
+/* Called periodically.  When a slot stops being suppressed, catch up
+   with the route selection and updates that we held back. */
+static void
+release_damped_slot(struct route_slot *slot)
+{
+    struct babel_route *route;
+    struct source *src;
+
+    if(!slot->suppressed || slot_suppressed(slot))
+        return;
+
+    debugf("Reusing %s from %s.\n",
+           format_prefix(slot->routes->src->prefix,
+                         slot->routes->src->plen),
+           format_prefix(slot->routes->src->src_prefix,
+                         slot->routes->src->src_plen));
+    slot->suppressed = 0;
+
+    src = slot->routes->src;
+    route = find_best_route(src->prefix, src->plen,
+                            src->src_prefix, src->src_plen, 1, NULL);
+    if(route)
+        consider_route(route);
+    send_update(NULL, 0, src->prefix, src->plen,
+                src->src_prefix, src->src_plen);
+}
+
+/* Returns -1 if damping is disabled, otherwise whether the destination of
+   route is suppressed. */
+int
+route_damping(const struct babel_route *route,
+              unsigned int *penalty_return, unsigned int *flaps_return)
+{
+    struct route_slot *slot;
+
+    if(damping_half_life <= 0)
+        return -1;
+
+    slot = find_route_slot(route->src->prefix, route->src->plen,
+                           route->src->src_prefix, route->src->src_plen,
+                           NULL, NULL);
+    if(slot == NULL)
+        return -1;
+
+    *penalty_return = slot_penalty(slot);
+    *flaps_return = slot->flaps;
+    return slot_suppressed(slot);
+}
+
+/* Called before route is freed. */
+static void
+forget_multipath_member(struct route_slot *slot, struct babel_route *route)
+{
+    int i;
+
+    for(i = 0; i < slot->multipath_len; i++) {
+        if(slot->multipath[i].route == route)
+            slot->multipath[i].route = NULL;
+    }
+}
+
 int
 update_feasible(struct source *src,
                 unsigned short seqno, unsigned short refmetric)
@@ -650,6 +1200,12 @@ update_feasible(struct source *src,
 void
 change_smoothing_half_life(int half_life)
 {
+    struct route_slot *slot;
+    int i;
+
+    for(slot = first_route_slot(); slot; slot = next_route_slot(slot))
+        invalidate_slot(slot);
+
     if(half_life <= 0) {
         smoothing_half_life = 0;
         two_to_the_one_over_hl = 0;
@@ -666,6 +1222,12 @@ change_smoothing_half_life(int half_life)
         /* 2^(1/x) is 1 + log(2)/x + O(1/x^2) at infinity. */
         two_to_the_one_over_hl = 0x10000 + 45426 / half_life;
     }
+
+    smoothing_decay[0] = 0x100000000ULL / two_to_the_one_over_hl;
+    for(i = 1; i < SMOOTHING_DECAY_BITS; i++)
+        smoothing_decay[i] =
+            ((unsigned long long)smoothing_decay[i - 1] *
+             smoothing_decay[i - 1]) >> 16;
 }
 
 /* Update the smoothed metric, return the new value. */
@@ -682,18 +1244,33 @@ route_smoothed_metric(struct babel_route *route)
         route->smoothed_metric_time = now.tv_sec;
     } else {
         int diff;
-        /* We randomise the computation, to minimise global synchronisation
-           and hence oscillations. */
-        while(route->smoothed_metric_time <= now.tv_sec - smoothing_half_life) {
-            diff = metric - route->smoothed_metric;
-            route->smoothed_metric += roughly(diff) / 2;
-            route->smoothed_metric_time += smoothing_half_life;
-        }
-        while(route->smoothed_metric_time < now.tv_sec) {
+        if(route->smoothed_metric_time < now.tv_sec) {
+            unsigned elapsed = now.tv_sec - route->smoothed_metric_time;
+            unsigned halvings = elapsed / smoothing_half_life;
+            unsigned rest = elapsed % smoothing_half_life;
             diff = metric - route->smoothed_metric;
-            route->smoothed_metric +=
-                roughly(diff) * (two_to_the_one_over_hl - 0x10000) / 0x10000;
-            route->smoothed_metric_time++;
+            if(halvings >= 16) {
+                /* Less than one unit of diff could remain. */
+                route->smoothed_metric = metric;
+            } else {
+                /* The distance to metric decays by 2^(-elapsed/hl).  Take
+                   the whole half-lives as a shift, and the remainder
+                   from the table bit by bit. */
+                unsigned long long factor = 0x10000 >> halvings;
+                int i, remaining, moved;
+                for(i = 0; rest != 0; i++, rest >>= 1) {
+                    if(rest & 1)
+                        factor = (factor * smoothing_decay[i]) >> 16;
+                }
+                remaining = (diff * (long long)factor) / 0x10000;
+                /* We randomise the computation, to minimise global
+                   synchronisation and hence oscillations. */
+                moved = roughly(diff - remaining);
+                if(diff >= 0 ? moved > diff : moved < diff)
+                    moved = diff;
+                route->smoothed_metric += moved;
+            }
+            route->smoothed_metric_time = now.tv_sec;
         }
 
         diff = metric - route->smoothed_metric;
@@ -730,29 +1307,83 @@ find_best_route(const unsigned char *prefix, unsigned char plen,
                 int feasible, struct neighbour *exclude)
 {
     struct babel_route *route, *r;
-    int i = find_route_slot(prefix, plen, src_prefix, src_plen, NULL);
+    struct route_slot *slot =
+        find_route_slot(prefix, plen, src_prefix, src_plen, NULL, NULL);
+    int f = !!feasible;
 
-    if(i < 0)
+    if(slot == NULL)
         return NULL;
 
-    route = routes[i];
+    if(exclude == NULL && slot->best_time == now.tv_sec &&
+       (slot->best_valid & (1 << f)))
+        return slot->best[f];
+
+    route = slot->routes;
     while(route && !route_acceptable(route, feasible, exclude))
         route = route->next;
 
-    if(!route)
-        return NULL;
+    if(route) {
+        r = route->next;
+        while(r) {
+            if(route_acceptable(r, feasible, exclude) &&
+               (route_smoothed_metric(r) < route_smoothed_metric(route)))
+                route = r;
+            r = r->next;
+        }
+    }
 
-    r = route->next;
-    while(r) {
-        if(route_acceptable(r, feasible, exclude) &&
-           (route_smoothed_metric(r) < route_smoothed_metric(route)))
-            route = r;
-        r = r->next;
+    if(exclude == NULL) {
+        if(slot->best_time != now.tv_sec) {
+            slot->best_valid = 0;
+            slot->best_time = now.tv_sec;
+        }
+        slot->best[f] = route;
+        slot->best_metric[f] = route ? route_smoothed_metric(route) : 0;
+        slot->best_valid |= 1 << f;
     }
 
     return route;
 }
 
+/* Called after the metric, feasibility or expiry of route has changed.
+   Updates the cached best routes of its slot without a rescan, unless
+   route was the best one and got worse. */
+static void
+update_best_route(struct babel_route *route)
+{
+    struct route_slot *slot =
+        find_route_slot(route->src->prefix, route->src->plen,
+                        route->src->src_prefix, route->src->src_plen,
+                        NULL, NULL);
+    unsigned short metric;
+    int f;
+
+    if(slot == NULL)
+        return;
+
+    if(slot->best_time != now.tv_sec) {
+        slot->best_valid = 0;
+        return;
+    }
+
+    metric = route_smoothed_metric(route);
+    for(f = 0; f < 2; f++) {
+        if(!(slot->best_valid & (1 << f)))
+            continue;
+        if(slot->best[f] == route) {
+            if(!route_acceptable(route, f, NULL) ||
+               metric > slot->best_metric[f])
+                slot->best_valid &= ~(1 << f);
+            else
+                slot->best_metric[f] = metric;
+        } else if(route_acceptable(route, f, NULL) &&
+                  (slot->best[f] == NULL || metric < slot->best_metric[f])) {
+            slot->best[f] = route;
+            slot->best_metric[f] = metric;
+        }
+    }
+}
+
 void
 update_route_metric(struct babel_route *route)
 {
@@ -789,16 +1420,10 @@ update_neighbour_metric(struct neighbour *neigh, int changed)
 {
 
     if(changed) {
-        int i;
-
-        for(i = 0; i < route_slots; i++) {
-            struct babel_route *r = routes[i];
-            while(r) {
-                if(r->neigh == neigh)
-                    update_route_metric(r);
-                r = r->next;
-            }
-        }
+        struct babel_route *r;
+
+        for(r = neigh->routes; r; r = r->neigh_next)
+            update_route_metric(r);
     }
 
     local_notify_neighbour(neigh, LOCAL_CHANGE);
@@ -806,17 +1431,137 @@ update_neighbour_metric(struct neighbour *neigh, int changed)
 
 void
 update_interface_metric(struct interface *ifp)
+{
+    struct neighbour *neigh;
+    struct babel_route *r;
+
+    FOR_INTERFACE_NEIGHBOURS(neigh, ifp) {
+        for(r = neigh->routes; r; r = r->neigh_next)
+            update_route_metric(r);
+    }
+}
+
+/* While a packet is being parsed, route selection and triggered updates
+   are deferred until the end of the packet, so that each destination is
+   considered only once.  A packet comes from a single neighbour, so there
+   is at most one pending route per destination. */
+
+struct route_update {
+    struct babel_route *route;
+    struct source *oldsrc;      /* NULL for a new route */
+    unsigned short oldmetric;
+    short oldinstalled;
+};
+
+static struct route_update *route_batch = NULL;
+static int route_batch_len = 0, route_batch_max = 0;
+static int route_batching = 0;
+
+/* Queues an update to route.  Returns 1 if it has been queued, in which
+   case the batch takes over the reference to oldsrc. */
+static int
+batch_route_update(struct babel_route *route, struct source *oldsrc,
+                   unsigned short oldmetric, int oldinstalled)
+{
+    struct route_update *u;
+
+    if(!route_batching)
+        return 0;
+
+    if(route->pending) {
+        /* Keep the state from before the first update. */
+        if(oldsrc)
+            release_source(oldsrc);
+        return 1;
+    }
+
+    if(route_batch_len >= route_batch_max) {
+        int n = route_batch_max < 1 ? 64 : 2 * route_batch_max;
+        struct route_update *new_batch =
+            realloc(route_batch, n * sizeof(struct route_update));
+        if(new_batch == NULL)
+            return 0;
+        route_batch = new_batch;
+        route_batch_max = n;
+    }
+
+    u = &route_batch[route_batch_len++];
+    u->route = route;
+    u->oldsrc = oldsrc;
+    u->oldmetric = oldmetric;
+    u->oldinstalled = oldinstalled;
+    route->pending = 1;
+    return 1;
+}
+
+/* Called by flush_route. */
+static void
+cancel_route_update(struct babel_route *route)
 {
     int i;
 
-    for(i = 0; i < route_slots; i++) {
-        struct babel_route *r = routes[i];
-        while(r) {
-            if(r->neigh->ifp == ifp)
-                update_route_metric(r);
-            r = r->next;
+    for(i = 0; i < route_batch_len; i++) {
+        if(route_batch[i].route == route) {
+            if(route_batch[i].oldsrc)
+                release_source(route_batch[i].oldsrc);
+            route_batch[i].route = NULL;
+            break;
         }
     }
+    route->pending = 0;
+}
+
+static void
+process_route_update(struct route_update *u)
+{
+    struct babel_route *route = u->route;
+    struct source *src = route->src;
+
+    route->pending = 0;
+
+    if(u->oldsrc == NULL) {
+        consider_route(route);
+        return;
+    }
+
+    route_changed(route, u->oldsrc, u->oldmetric);
+    if(u->oldinstalled &&
+       find_installed_route(src->prefix, src->plen,
+                            src->src_prefix, src->src_plen) == NULL)
+        route_lost(u->oldsrc, u->oldmetric);
+    else if(!route_feasible(route))
+        send_unfeasible_request(route->neigh, route_old(route),
+                                route->seqno, route_metric(route), src);
+    release_source(u->oldsrc);
+}
+
+void
+begin_route_batch(void)
+{
+    route_batching = 1;
+}
+
+/* Run the deferred work, but keep batching. */
+void
+flush_route_batch(void)
+{
+    int i, batching = route_batching;
+
+    /* Processing may flush routes, which scans the batch. */
+    route_batching = 0;
+    for(i = 0; i < route_batch_len; i++) {
+        if(route_batch[i].route)
+            process_route_update(&route_batch[i]);
+    }
+    route_batch_len = 0;
+    route_batching = batching;
+}
+
+void
+end_route_batch(void)
+{
+    flush_route_batch();
+    route_batching = 0;
 }
 
 /* This is called whenever we receive an update. */
@@ -922,6 +1667,10 @@ update_route(const unsigned char *id,
         change_route_metric(route,
                             refmetric, neighbour_cost(neigh), add_metric);
         route->hold_time = hold_time;
+        update_best_route(route);
+
+        if(batch_route_update(route, oldsrc, oldmetric, oldinstalled))
+            return route;
 
         route_changed(route, oldsrc, oldmetric);
         if(!lost) {
@@ -949,19 +1698,24 @@ update_route(const unsigned char *id,
             send_unfeasible_request(neigh, 0, seqno, metric, src);
         }
 
-        route = calloc(1, sizeof(struct babel_route));
+        route = pool_alloc(&route_pool);
         if(route == NULL) {
             perror("malloc(route)");
             return NULL;
         }
 
+        route->nexthop = intern_nexthop(neigh, nexthop);
+        if(route->nexthop == NULL) {
+            perror("malloc(nexthop)");
+            pool_free(&route_pool, route);
+            return NULL;
+        }
         route->src = retain_source(src);
         route->refmetric = refmetric;
         route->cost = neighbour_cost(neigh);
         route->add_metric = add_metric;
         route->seqno = seqno;
         route->neigh = neigh;
-        memcpy(route->nexthop, nexthop, 16);
         route->time = now.tv_sec;
         route->hold_time = hold_time;
         route->smoothed_metric = MAX(route_metric(route), INFINITY / 2);
@@ -974,7 +1728,8 @@ update_route(const unsigned char *id,
             return NULL;
         }
         local_notify_route(route, LOCAL_ADD);
-        consider_route(route);
+        if(!batch_route_update(route, NULL, INFINITY, 0))
+            consider_route(route);
     }
     return route;
 }
@@ -1040,6 +1795,14 @@ consider_route(struct babel_route *route)
     if(route_metric(installed) >= INFINITY)
         goto install;
 
+    /* Damping only holds back switches between two usable routes. */
+    if(damping_half_life > 0 &&
+       slot_suppressed(find_route_slot(route->src->prefix, route->src->plen,
+                                       route->src->src_prefix,
+                                       route->src->src_plen,
+                                       NULL, NULL)))
+        return;
+
     if(route_metric(installed) >= route_metric(route) &&
        route_smoothed_metric(installed) > route_smoothed_metric(route))
         goto install;
@@ -1059,20 +1822,14 @@ consider_route(struct babel_route *route)
 void
 retract_neighbour_routes(struct neighbour *neigh)
 {
-    int i;
+    struct babel_route *r;
 
-    for(i = 0; i < route_slots; i++) {
-        struct babel_route *r = routes[i];
-        while(r) {
-            if(r->neigh == neigh) {
-                if(r->refmetric != INFINITY) {
-                    unsigned short oldmetric = route_metric(r);
-                    retract_route(r);
-                    if(oldmetric != INFINITY)
-                        route_changed(r, r->src, oldmetric);
-                }
-            }
-            r = r->next;
+    for(r = neigh->routes; r; r = r->neigh_next) {
+        if(r->refmetric != INFINITY) {
+            unsigned short oldmetric = route_metric(r);
+            retract_route(r);
+            if(oldmetric != INFINITY)
+                route_changed(r, r->src, oldmetric);
         }
     }
 }
@@ -1117,6 +1874,19 @@ send_triggered_update(struct babel_route *route, struct source *oldsrc,
     else
         urgent = 0;
 
+    if(damping_half_life > 0) {
+        struct route_slot *slot =
+            find_route_slot(route->src->prefix, route->src->plen,
+                            route->src->src_prefix, route->src->src_plen,
+                            NULL, NULL);
+        damp_slot(slot, urgent >= 2 ?
+                  DAMPING_PENALTY_WITHDRAW : DAMPING_PENALTY_CHANGE);
+        /* Announcing a route that replaces a retraction is never held
+           back, lest we blackhole our neighbours. */
+        if(urgent < 2 && oldmetric < INFINITY && slot_suppressed(slot))
+            return;
+    }
+
     if(urgent >= 2)
         send_update_resend(NULL, route->src->prefix, route->src->plen,
                            route->src->src_prefix, route->src->src_plen);
@@ -1189,18 +1959,24 @@ route_lost(struct source *src, unsigned oldmetric)
 void
 expire_routes(void)
 {
+    struct route_slot *slot, *next;
     struct babel_route *r;
-    int i;
 
     debugf("Expiring old routes.\n");
 
-    i = 0;
-    while(i < route_slots) {
-        r = routes[i];
+    slot = first_route_slot();
+    while(slot) {
+        next = next_route_slot(slot);
+        release_damped_slot(slot);
+    again:
+        r = slot->routes;
         while(r) {
             /* Protect against clock being stepped. */
             if(r->time > now.tv_sec || route_old(r)) {
+                int last = r == slot->routes && r->next == NULL;
                 flush_route(r);
+                if(last)
+                    break;
                 goto again;
             }
 
@@ -1215,8 +1991,6 @@ expire_routes(void)
             }
             r = r->next;
         }
-        i++;
-    again:
-        ;
+        slot = next;
     }
 }
@@ -20,26 +20,41 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
+/* The fields used by route selection come first, so that walking a slot
+   only touches the first cache line of each route.  Times are in seconds
+   of the monotonic clock, which fits in 32 bits. */
+
 struct babel_route {
+    struct babel_route *next;
     struct source *src;
+    struct neighbour *neigh;
     unsigned short refmetric;
     unsigned short cost;
     unsigned short add_metric;
     unsigned short seqno;
-    struct neighbour *neigh;
-    unsigned char nexthop[16];
-    time_t time;
-    unsigned short hold_time;    /* in seconds */
     unsigned short smoothed_metric; /* for route selection */
-    time_t smoothed_metric_time;
+    unsigned short hold_time;    /* in seconds */
+    unsigned int time;
+    unsigned int smoothed_metric_time;
     short installed;
-    struct babel_route *next;
+    short pending;              /* queued in the route batch */
+    /* Either neigh->address or an entry interned by the neighbour. */
+    const unsigned char *nexthop;
+    /* Doubly-linked list of the routes through the same neighbour. */
+    struct babel_route *neigh_next, *neigh_prev;
+};
+
+struct nexthop {
+    unsigned char address[16];
+    int refcount;
+    struct nexthop *next;
 };
 
 struct route_stream;
 
-extern struct babel_route **routes;
 extern int kernel_metric, allow_duplicates, reflect_kernel_metric;
+extern int multipath_tolerance;
+extern int damping_half_life, damping_suppress, damping_reuse;
 
 static inline int
 route_metric(const struct babel_route *route)
@@ -69,6 +84,9 @@ int update_feasible(struct source *src,
                     unsigned short seqno, unsigned short refmetric);
 void change_smoothing_half_life(int half_life);
 int route_smoothed_metric(struct babel_route *route);
+void invalidate_best_route(const struct source *src);
+int route_damping(const struct babel_route *route,
+                  unsigned int *penalty_return, unsigned int *flaps_return);
 struct babel_route *find_best_route(const unsigned char *prefix,
                                     unsigned char plen,
                                     const unsigned char *src_prefix,
@@ -94,6 +112,9 @@ void send_unfeasible_request(struct neighbour *neigh, int force,
 void consider_route(struct babel_route *route);
 void send_triggered_update(struct babel_route *route,
                            struct source *oldsrc, unsigned oldmetric);
+void begin_route_batch(void);
+void flush_route_batch(void);
+void end_route_batch(void);
 void route_changed(struct babel_route *route,
                    struct source *oldsrc, unsigned short oldmetric);
 void route_lost(struct source *src, unsigned oldmetric);
@@ -33,10 +33,49 @@ THE SOFTWARE.
 #include "source.h"
 #include "interface.h"
 #include "route.h"
+#include "pool.h"
 
 static struct source **sources = NULL;
 static int source_slots = 0, max_source_slots = 0;
 
+static struct pool source_pool =
+    POOL_INITIALIZER("source", sizeof(struct source));
+
+/* Maximum number of sources reclaimed by a single call to expire_sources. */
+#define SOURCE_GC_BUDGET 64
+
+/* Sources with a route_count of zero are kept on a queue, in the order
+   in which they became unreferenced or were last updated.  Since the
+   time of a source is never later than the time at which it was queued,
+   only looking at the head delays collection by at most SOURCE_GC_TIME. */
+static struct source *gc_head = NULL, *gc_tail = NULL;
+
+static void
+gc_enqueue(struct source *src)
+{
+    src->gc_next = NULL;
+    src->gc_prev = gc_tail;
+    if(gc_tail)
+        gc_tail->gc_next = src;
+    else
+        gc_head = src;
+    gc_tail = src;
+}
+
+static void
+gc_dequeue(struct source *src)
+{
+    if(src->gc_prev)
+        src->gc_prev->gc_next = src->gc_next;
+    else
+        gc_head = src->gc_next;
+    if(src->gc_next)
+        src->gc_next->gc_prev = src->gc_prev;
+    else
+        gc_tail = src->gc_prev;
+    src->gc_next = src->gc_prev = NULL;
+}
+
 static int
 source_compare(const unsigned char *id,
                const unsigned char *prefix, unsigned char plen,
@@ -70,35 +109,59 @@ source_compare(const unsigned char *id,
     return 0;
 }
 
+static unsigned int
+source_hash(const unsigned char *id,
+            const unsigned char *prefix, unsigned char plen,
+            const unsigned char *src_prefix, unsigned char src_plen)
+{
+    /* FNV-1a */
+    unsigned int h = 2166136261U;
+    int i;
+
+#define HASH_BYTE(_b) do { h ^= (_b); h *= 16777619U; } while(0)
+    for(i = 0; i < 8; i++)
+        HASH_BYTE(id[i]);
+    for(i = 0; i < 16; i++)
+        HASH_BYTE(prefix[i]);
+    HASH_BYTE(plen);
+    for(i = 0; i < 16; i++)
+        HASH_BYTE(src_prefix[i]);
+    HASH_BYTE(src_plen);
+#undef HASH_BYTE
+
+    return h;
+}
+
+/* The sources live in an open-addressing hash table with linear probing,
+   which is never more than half full.  Returns the index of the source,
+   or -1 if it is not found, in which case new_return is set to the free
+   slot where it should be inserted. */
+
 static int
 find_source_slot(const unsigned char *id,
                  const unsigned char *prefix, unsigned char plen,
                  const unsigned char *src_prefix, unsigned char src_plen,
                  int *new_return)
 {
-    int p, m, g, c;
+    int i;
 
-    if(source_slots < 1) {
+    if(max_source_slots < 1) {
         if(new_return)
-            *new_return = 0;
+            *new_return = -1;
         return -1;
     }
 
-    p = 0; g = source_slots - 1;
-
-    do {
-        m = (p + g) / 2;
-        c = source_compare(id, prefix, plen, src_prefix, src_plen, sources[m]);
-        if(c == 0)
-            return m;
-        else if(c < 0)
-            g = m - 1;
-        else
-            p = m + 1;
-    } while(p <= g);
+    i = source_hash(id, prefix, plen, src_prefix, src_plen) &
+        (max_source_slots - 1);
+    while(sources[i]) {
+        if(source_compare(id, prefix, plen, src_prefix, src_plen,
+                          sources[i]) == 0)
+            return i;
+        i = (i + 1) & (max_source_slots - 1);
+    }
 
     if(new_return)
-        *new_return = p;
+        *new_return = i;
 
     return -1;
 }
@@ -106,23 +169,62 @@ find_source_slot(const unsigned char *id,
 static int
 resize_source_table(int new_slots)
 {
-    struct source **new_sources;
-    assert(new_slots >= source_slots);
-
-    if(new_slots == 0) {
-        new_sources = NULL;
-        free(sources);
-    } else {
-        new_sources = realloc(sources, new_slots * sizeof(struct source*));
-        if(new_sources == NULL)
-            return -1;
-    }
+    struct source **old_sources = sources;
+    int old_slots = max_source_slots;
+    int i;
 
+    assert(new_slots >= 2 * source_slots);
+    assert((new_slots & (new_slots - 1)) == 0);
+
+    sources = calloc(new_slots, sizeof(struct source*));
+    if(sources == NULL) {
+        sources = old_sources;
+        return -1;
+    }
     max_source_slots = new_slots;
-    sources = new_sources;
+
+    for(i = 0; i < old_slots; i++) {
+        struct source *src = old_sources[i];
+        int n = -1;
+        if(src == NULL)
+            continue;
+        find_source_slot(src->id, src->prefix, src->plen,
+                         src->src_prefix, src->src_plen, &n);
+        assert(n >= 0);
+        sources[n] = src;
+    }
+
+    free(old_sources);
     return 1;
 }
 
+/* Remove the entry at index i, moving back any following entries that
+   would otherwise become unreachable. */
+static void
+remove_source_slot(int i)
+{
+    int j = i, mask = max_source_slots - 1;
+
+    sources[i] = NULL;
+    source_slots--;
+
+    while(1) {
+        int k;
+        j = (j + 1) & mask;
+        if(sources[j] == NULL)
+            break;
+        k = source_hash(sources[j]->id, sources[j]->prefix, sources[j]->plen,
+                        sources[j]->src_prefix, sources[j]->src_plen) & mask;
+        /* Move the entry at j back to i unless its home k lies
+           cyclically within (i, j]. */
+        if(i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        sources[i] = sources[j];
+        sources[j] = NULL;
+        i = j;
+    }
+}
+
 struct source*
 find_source(const unsigned char *id,
             const unsigned char *prefix, unsigned char plen,
@@ -139,7 +241,7 @@ find_source(const unsigned char *id,
     if(!create)
         return NULL;
 
-    src = calloc(1, sizeof(struct source));
+    src = pool_alloc(&source_pool);
     if(src == NULL) {
         perror("malloc(source)");
         return NULL;
@@ -154,17 +256,17 @@ find_source(const unsigned char *id,
     src->metric = INFINITY;
     src->time = now.tv_sec;
 
-    if(source_slots >= max_source_slots)
-        resize_source_table(max_source_slots < 1 ? 8 : 2 * max_source_slots);
-    if(source_slots >= max_source_slots) {
-        free(src);
+    if(2 * (source_slots + 1) > max_source_slots) {
+        resize_source_table(max_source_slots < 1 ? 16 : 2 * max_source_slots);
+        find_source_slot(id, prefix, plen, src_prefix, src_plen, &n);
+    }
+    if(2 * (source_slots + 1) > max_source_slots) {
+        pool_free(&source_pool, src);
         return NULL;
     }
-    if(n < source_slots)
-        memmove(sources + n + 1, sources + n,
-                (source_slots - n) * sizeof(struct source*));
     source_slots++;
     sources[n] = src;
+    gc_enqueue(src);
 
     return src;
 }
@@ -173,6 +275,8 @@ struct source *
 retain_source(struct source *src)
 {
     assert(src->route_count < 0xffff);
+    if(src->route_count == 0)
+        gc_dequeue(src);
     src->route_count++;
     return src;
 }
@@ -182,6 +286,8 @@ release_source(struct source *src)
 {
     assert(src->route_count > 0);
     src->route_count--;
+    if(src->route_count == 0)
+        gc_enqueue(src);
 }
 
 void
@@ -202,33 +308,50 @@ update_source(struct source *src,
         src->metric = metric;
     }
     src->time = now.tv_sec;
+    if(src->route_count == 0) {
+        /* Keep the queue ordered. */
+        gc_dequeue(src);
+        gc_enqueue(src);
+    }
+    invalidate_best_route(src);
 }
 
-void
+/* Reclaim a bounded number of expired sources.  Returns the time at
+   which this should be called again. */
+time_t
 expire_sources()
 {
-    int i = 0, j = 0;
-    while(i < source_slots) {
-        struct source *src = sources[i];
+    int budget = SOURCE_GC_BUDGET;
+
+    while(gc_head) {
+        struct source *src = gc_head;
+        int i;
 
-        if(src->time > now.tv_sec)
+        if(src->time > now.tv_sec) {
             /* clock stepped */
             src->time = now.tv_sec;
-
-        if(src->route_count == 0 && src->time < now.tv_sec - SOURCE_GC_TIME) {
-            free(src);
-            sources[i] = NULL;
-            i++;
-        } else {
-            if(j < i) {
-                sources[j] = sources[i];
-                sources[i] = NULL;
-            }
-            i++;
-            j++;
+            gc_dequeue(src);
+            gc_enqueue(src);
+            invalidate_best_route(src);
+            continue;
         }
+
+        if(src->time >= now.tv_sec - SOURCE_GC_TIME)
+            return src->time + SOURCE_GC_TIME + 1;
+
+        if(budget <= 0)
+            return now.tv_sec;
+
+        i = find_source_slot(src->id, src->prefix, src->plen,
+                             src->src_prefix, src->src_plen, NULL);
+        assert(i >= 0 && sources[i] == src);
+        remove_source_slot(i);
+        gc_dequeue(src);
+        pool_free(&source_pool, src);
+        budget--;
     }
-    source_slots = j;
+
+    return now.tv_sec + SOURCE_GC_TIME + 1;
 }
 
 void
@@ -236,10 +359,10 @@ check_sources_released(void)
 {
     int i;
 
-    for(i = 0; i < source_slots; i++) {
+    for(i = 0; i < max_source_slots; i++) {
         struct source *src = sources[i];
 
-        if(src->route_count != 0)
+        if(src != NULL && src->route_count != 0)
             fprintf(stderr, "Warning: source %s %s has refcount %d.\n",
                     format_eui64(src->id),
                     format_prefix(src->prefix, src->plen),
@@ -32,6 +32,8 @@ struct source {
     unsigned short metric;
     unsigned short route_count;
     time_t time;
+    /* Unreferenced sources are queued for garbage collection. */
+    struct source *gc_next, *gc_prev;
 };
 
 struct source *find_source(const unsigned char *id,
@@ -44,5 +46,5 @@ struct source *retain_source(struct source *src);
 void release_source(struct source *src);
 void update_source(struct source *src,
                    unsigned short seqno, unsigned short metric);
-void expire_sources(void);
+time_t expire_sources(void);
 void check_sources_released(void);
@@ -43,6 +43,79 @@ THE SOFTWARE.
 static struct xroute *xroutes;
 static int numxroutes = 0, maxxroutes = 0;
 
+/* Values of xroute->mark. */
+#define XROUTE_UNSEEN 0
+#define XROUTE_SEEN 1
+#define XROUTE_ADDED 2
+#define XROUTE_DELETED 3
+
+int aggregate_xroutes = 0;
+
+/* Aggregates announced instead of two sibling xroutes (or aggregates)
+   with the same source prefix and metric.  Since both halves must be
+   present, aggregation never changes what we can reach. */
+static struct xroute *xaggregates;
+static int numxaggregates = 0, maxxaggregates = 0;
+
+/* Exported routes are hashed into buckets, and we keep for every bucket
+   the sum of the hashes of its contents.  The periodic check compares
+   these digests with those of the kernel tables, and only looks at the
+   buckets that disagree. */
+
+#define XROUTE_DIGEST_BUCKETS 256
+
+static unsigned long long xroute_digest[XROUTE_DIGEST_BUCKETS];
+
+static unsigned long long
+xroute_hash(const unsigned char *prefix, unsigned char plen,
+            const unsigned char *src_prefix, unsigned char src_plen)
+{
+    /* FNV-1a */
+    unsigned long long h = 14695981039346656037ULL;
+    int i;
+
+    for(i = 0; i < 16; i++)
+        h = (h ^ prefix[i]) * 1099511628211ULL;
+    h = (h ^ plen) * 1099511628211ULL;
+    for(i = 0; i < 16; i++)
+        h = (h ^ src_prefix[i]) * 1099511628211ULL;
+    h = (h ^ src_plen) * 1099511628211ULL;
+    return h;
+}
+
+static int
+digest_bucket(unsigned long long hash)
+{
+    return hash >> 56;
+}
+
+static unsigned long long
+digest_term(unsigned long long hash, unsigned short metric, int proto)
+{
+    unsigned long long x;
+
+    x = hash ^ ((unsigned long long)metric << 32) ^ (unsigned int)proto;
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static void
+digest_xroute(const struct xroute *xroute, int add)
+{
+    unsigned long long h = xroute_hash(xroute->prefix, xroute->plen,
+                                       xroute->src_prefix, xroute->src_plen);
+    unsigned long long t = digest_term(h, xroute->metric, xroute->proto);
+
+    if(add)
+        xroute_digest[digest_bucket(h)] += t;
+    else
+        xroute_digest[digest_bucket(h)] -= t;
+}
+
 static int
 xroute_compare(const unsigned char *prefix, unsigned char plen,
                const unsigned char *src_prefix, unsigned char src_plen,
@@ -72,23 +145,24 @@ xroute_compare(const unsigned char *prefix, unsigned char plen,
 }
 
 static int
-find_xroute_slot(const unsigned char *prefix, unsigned char plen,
-                 const unsigned char *src_prefix, unsigned char src_plen,
-                 int *new_return)
+find_slot(const struct xroute *array, int n,
+          const unsigned char *prefix, unsigned char plen,
+          const unsigned char *src_prefix, unsigned char src_plen,
+          int *new_return)
 {
     int p, m, g, c;
 
-    if(numxroutes < 1) {
+    if(n < 1) {
         if(new_return)
             *new_return = 0;
         return -1;
     }
 
-    p = 0; g = numxroutes - 1;
+    p = 0; g = n - 1;
 
     do {
         m = (p + g) / 2;
-        c = xroute_compare(prefix, plen, src_prefix, src_plen, &xroutes[m]);
+        c = xroute_compare(prefix, plen, src_prefix, src_plen, &array[m]);
         if(c == 0)
             return m;
         else if(c < 0)
@@ -103,7 +177,16 @@ find_xroute_slot(const unsigned char *prefix, unsigned char plen,
     return -1;
 }
 
+static int
+find_xroute_slot(const unsigned char *prefix, unsigned char plen,
+                 const unsigned char *src_prefix, unsigned char src_plen,
+                 int *new_return)
+{
+    return find_slot(xroutes, numxroutes,
+                     prefix, plen, src_prefix, src_plen, new_return);
+}
 
+/* Returns an xroute or an aggregate. */
 struct xroute *
 find_xroute(const unsigned char *prefix, unsigned char plen,
             const unsigned char *src_prefix, unsigned char src_plen)
@@ -112,9 +195,205 @@ find_xroute(const unsigned char *prefix, unsigned char plen,
     if(i >= 0)
         return &xroutes[i];
 
+    i = find_slot(xaggregates, numxaggregates,
+                  prefix, plen, src_prefix, src_plen, NULL);
+    if(i >= 0)
+        return &xaggregates[i];
+
     return NULL;
 }
 
+static int
+can_aggregate(const unsigned char *prefix, unsigned char plen)
+{
+    if(plen == 0)
+        return 0;
+    /* Don't aggregate IPv4 prefixes into IPv6 ones. */
+    if(v4mapped(prefix) && plen <= 96)
+        return 0;
+    return 1;
+}
+
+/* The other half of the prefix above prefix. */
+static void
+sibling_prefix(unsigned char *ret,
+               const unsigned char *prefix, unsigned char plen)
+{
+    memcpy(ret, prefix, 16);
+    ret[(plen - 1) / 8] ^= 0x80 >> ((plen - 1) % 8);
+}
+
+/* Announce an aggregate for prefix and its sibling if they are exported
+   with the same metric, and keep going up as long as possible. */
+static void
+aggregate_xroute(const unsigned char *p, unsigned char plen,
+                 const unsigned char *sp, unsigned char src_plen)
+{
+    unsigned char prefix[16], sibling[16], parent[16], src_prefix[16];
+    struct xroute *xroute, *other, *aggregate;
+    struct filter_result filter_result;
+    int metric, i, n;
+
+    memcpy(prefix, p, 16);
+    memcpy(src_prefix, sp, 16);
+
+    while(aggregate_xroutes && can_aggregate(prefix, plen)) {
+        xroute = find_xroute(prefix, plen, src_prefix, src_plen);
+        if(xroute == NULL || xroute->suppressed ||
+           xroute->mark == XROUTE_DELETED)
+            return;
+        sibling_prefix(sibling, prefix, plen);
+        other = find_xroute(sibling, plen, src_prefix, src_plen);
+        if(other == NULL || other->suppressed ||
+           other->mark == XROUTE_DELETED || other->metric != xroute->metric)
+            return;
+        normalize_prefix(parent, prefix, plen - 1);
+        if(find_xroute(parent, plen - 1, src_prefix, src_plen) ||
+           find_installed_route(parent, plen - 1, src_prefix, src_plen))
+            return;
+
+        /* The aggregate must pass the same filters. */
+        metric = redistribute_filter(parent, plen - 1, src_prefix, src_plen,
+                                     xroute->ifindex, xroute->proto,
+                                     &filter_result);
+        if(metric != xroute->metric ||
+           (filter_result.src_prefix != NULL &&
+            (filter_result.src_plen != src_plen ||
+             memcmp(filter_result.src_prefix, src_prefix, 16) != 0)))
+            return;
+
+        i = find_slot(xaggregates, numxaggregates,
+                      parent, plen - 1, src_prefix, src_plen, &n);
+        assert(i < 0);
+
+        if(numxaggregates >= maxxaggregates) {
+            struct xroute *new_xaggregates;
+            int num = maxxaggregates < 1 ? 8 : 2 * maxxaggregates;
+            new_xaggregates =
+                realloc(xaggregates, num * sizeof(struct xroute));
+            if(new_xaggregates == NULL)
+                return;
+            maxxaggregates = num;
+            xaggregates = new_xaggregates;
+            /* xroute or other may have pointed into the old array. */
+            xroute = find_xroute(prefix, plen, src_prefix, src_plen);
+            other = find_xroute(sibling, plen, src_prefix, src_plen);
+        }
+
+        xroute->suppressed = other->suppressed = 1;
+
+        if(n < numxaggregates)
+            memmove(xaggregates + n + 1, xaggregates + n,
+                    (numxaggregates - n) * sizeof(struct xroute));
+        numxaggregates++;
+
+        aggregate = &xaggregates[n];
+        memset(aggregate, 0, sizeof(struct xroute));
+        memcpy(aggregate->prefix, parent, 16);
+        aggregate->plen = plen - 1;
+        memcpy(aggregate->src_prefix, src_prefix, 16);
+        aggregate->src_plen = src_plen;
+        aggregate->metric = metric;
+        aggregate->ifindex = xroute->ifindex;
+        aggregate->proto = xroute->proto;
+        aggregate->aggregate = 1;
+        local_notify_xroute(aggregate, LOCAL_ADD);
+
+        /* This retracts the more-specifics. */
+        send_update(NULL, 0, prefix, plen, src_prefix, src_plen);
+        send_update(NULL, 0, sibling, plen, src_prefix, src_plen);
+        send_update(NULL, 0, parent, plen - 1, src_prefix, src_plen);
+
+        memcpy(prefix, parent, 16);
+        plen--;
+    }
+}
+
+/* Stop announcing an aggregate, and announce its halves again. */
+static void
+dissolve_aggregate(const unsigned char *p, unsigned char plen,
+                   const unsigned char *sp, unsigned char src_plen)
+{
+    unsigned char prefix[16], child[16], src_prefix[16];
+    struct xroute *xroute;
+    int i, j;
+
+    memcpy(prefix, p, 16);
+    memcpy(src_prefix, sp, 16);
+
+    i = find_slot(xaggregates, numxaggregates,
+                  prefix, plen, src_prefix, src_plen, NULL);
+    if(i < 0)
+        return;
+
+    if(xaggregates[i].suppressed) {
+        unsigned char parent[16];
+        normalize_prefix(parent, prefix, plen - 1);
+        dissolve_aggregate(parent, plen - 1, src_prefix, src_plen);
+        i = find_slot(xaggregates, numxaggregates,
+                      prefix, plen, src_prefix, src_plen, NULL);
+        assert(i >= 0);
+    }
+
+    local_notify_xroute(&xaggregates[i], LOCAL_FLUSH);
+    if(i != numxaggregates - 1)
+        memmove(xaggregates + i, xaggregates + i + 1,
+                (numxaggregates - i - 1) * sizeof(struct xroute));
+    numxaggregates--;
+
+    for(j = 0; j < 2; j++) {
+        memcpy(child, prefix, 16);
+        if(j)
+            child[plen / 8] |= 0x80 >> (plen % 8);
+        xroute = find_xroute(child, plen + 1, src_prefix, src_plen);
+        if(xroute) {
+            xroute->suppressed = 0;
+            send_update(NULL, 0, child, plen + 1, src_prefix, src_plen);
+        }
+    }
+
+    /* A route learnt from a neighbour will be installed when it is
+       next updated. */
+    send_update(NULL, 0, prefix, plen, src_prefix, src_plen);
+}
+
+/* Dissolve the aggregate that suppresses xroute, if any. */
+static void
+unsuppress_xroute(struct xroute *xroute)
+{
+    unsigned char parent[16];
+
+    if(!xroute->suppressed)
+        return;
+
+    normalize_prefix(parent, xroute->prefix, xroute->plen - 1);
+    dissolve_aggregate(parent, xroute->plen - 1,
+                       xroute->src_prefix, xroute->src_plen);
+    assert(!xroute->suppressed);
+}
+
+void
+set_xroute_aggregation(int on)
+{
+    int i;
+
+    if(!!on == aggregate_xroutes)
+        return;
+
+    aggregate_xroutes = !!on;
+    if(aggregate_xroutes) {
+        for(i = numxroutes - 1; i >= 0; i--)
+            aggregate_xroute(xroutes[i].prefix, xroutes[i].plen,
+                             xroutes[i].src_prefix, xroutes[i].src_plen);
+    } else {
+        while(numxaggregates > 0) {
+            struct xroute *a = &xaggregates[numxaggregates - 1];
+            dissolve_aggregate(a->prefix, a->plen,
+                               a->src_prefix, a->src_plen);
+        }
+    }
+}
+
 int
 add_xroute(unsigned char prefix[16], unsigned char plen,
            unsigned char src_prefix[16], unsigned char src_plen,
@@ -126,6 +405,8 @@ add_xroute(unsigned char prefix[16], unsigned char plen,
     if(i >= 0)
         return -1;
 
+    dissolve_aggregate(prefix, plen, src_prefix, src_plen);
+
     if(numxroutes >= maxxroutes) {
         struct xroute *new_xroutes;
         int num = maxxroutes < 1 ? 8 : 2 * maxxroutes;
@@ -148,35 +429,18 @@ add_xroute(unsigned char prefix[16], unsigned char plen,
     xroutes[n].metric = metric;
     xroutes[n].ifindex = ifindex;
     xroutes[n].proto = proto;
+    xroutes[n].mark = 0;
+    xroutes[n].suppressed = 0;
+    xroutes[n].aggregate = 0;
+    digest_xroute(&xroutes[n], 1);
     local_notify_xroute(&xroutes[n], LOCAL_ADD);
+    aggregate_xroute(prefix, plen, src_prefix, src_plen);
     return 1;
 }
 
-void
-flush_xroute(struct xroute *xroute, int send_updates)
+static void
+shrink_xroutes(void)
 {
-    int i;
-    unsigned char prefix[16], plen;
-    unsigned char src_prefix[16], src_plen;
-    struct babel_route *route;
-
-    /* We'll use these after we free the xroute */
-    memcpy(prefix, xroute->prefix, 16);
-    plen = xroutes->plen;
-    memcpy(src_prefix, xroutes->src_prefix, 16);
-    src_plen = xroute->src_plen;
-
-    i = xroute - xroutes;
-    assert(i >= 0 && i < numxroutes);
-
-    local_notify_xroute(xroute, LOCAL_FLUSH);
-
-    if(i != numxroutes - 1)
-        memmove(xroutes + i, xroutes + i + 1,
-                (numxroutes - i - 1) * sizeof(struct xroute));
-    numxroutes--;
-    VALGRIND_MAKE_MEM_UNDEFINED(xroutes + numxroutes, sizeof(struct xroute));
-
     if(numxroutes == 0) {
         free(xroutes);
         xroutes = NULL;
@@ -184,12 +448,32 @@ flush_xroute(struct xroute *xroute, int send_updates)
     } else if(maxxroutes > 8 && numxroutes < maxxroutes / 4) {
         struct xroute *new_xroutes;
         int n = maxxroutes / 2;
+        while(n > 8 && numxroutes < n / 4)
+            n /= 2;
         new_xroutes = realloc(xroutes, n * sizeof(struct xroute));
         if(new_xroutes == NULL)
             return;
         xroutes = new_xroutes;
         maxxroutes = n;
     }
+}
+
+/* Start removing an xroute: everything but taking it out of the array. */
+static void
+retire_xroute(struct xroute *xroute)
+{
+    unsuppress_xroute(xroute);
+    digest_xroute(xroute, 0);
+    local_notify_xroute(xroute, LOCAL_FLUSH);
+}
+
+/* Called once the xroute to a prefix is gone. */
+static void
+xroute_removed(const unsigned char *prefix, unsigned char plen,
+               const unsigned char *src_prefix, unsigned char src_plen,
+               int send_updates)
+{
+    struct babel_route *route;
 
     route = find_best_route(prefix, plen, src_prefix, src_plen, 1, NULL);
     if(route != NULL && route_metric(route) < INFINITY &&
@@ -203,6 +487,34 @@ flush_xroute(struct xroute *xroute, int send_updates)
     }
 }
 
+void
+flush_xroute(struct xroute *xroute, int send_updates)
+{
+    int i;
+    unsigned char prefix[16], plen;
+    unsigned char src_prefix[16], src_plen;
+
+    /* We'll use these after we free the xroute */
+    memcpy(prefix, xroute->prefix, 16);
+    plen = xroute->plen;
+    memcpy(src_prefix, xroute->src_prefix, 16);
+    src_plen = xroute->src_plen;
+
+    i = xroute - xroutes;
+    assert(i >= 0 && i < numxroutes);
+
+    retire_xroute(xroute);
+
+    if(i != numxroutes - 1)
+        memmove(xroutes + i, xroutes + i + 1,
+                (numxroutes - i - 1) * sizeof(struct xroute));
+    numxroutes--;
+    VALGRIND_MAKE_MEM_UNDEFINED(xroutes + numxroutes, sizeof(struct xroute));
+    shrink_xroutes();
+
+    xroute_removed(prefix, plen, src_prefix, src_plen, send_updates);
+}
+
 /* Returns an overestimate of the number of xroutes. */
 int
 xroutes_estimate()
@@ -231,6 +543,8 @@ xroute_stream_next(struct xroute_stream *stream)
 {
     if(stream->index < numxroutes)
         return &xroutes[stream->index++];
+    else if(stream->index < numxroutes + numxaggregates)
+        return &xaggregates[stream->index++ - numxroutes];
     else
         return NULL;
 }
@@ -241,36 +555,51 @@ xroute_stream_done(struct xroute_stream *stream)
     free(stream);
 }
 
-static void
-filter_route(int add, struct kernel_route *route, void *data) {
-    void **args = (void**)data;
-    int maxroutes = *(int*)args[0];
-    struct kernel_route *routes = (struct kernel_route *)args[1];
-    int *found = (int*)args[2];
+/* Apply the redistribution filters to a kernel route or address.
+   Returns 1 if it should be exported and falls into one of the selected
+   buckets (all buckets if buckets is NULL). */
+static int
+select_kernel_route(struct kernel_route *kroute, const unsigned char *buckets)
+{
+    struct filter_result filter_result;
+    unsigned long long h;
 
-    if(*found >= maxroutes)
-        return;
+    kroute->metric = redistribute_filter(kroute->prefix, kroute->plen,
+                                         kroute->src_prefix, kroute->src_plen,
+                                         kroute->ifindex, kroute->proto,
+                                         &filter_result);
+    if(filter_result.src_prefix != NULL) {
+        memcpy(kroute->src_prefix, filter_result.src_prefix, 16);
+        kroute->src_plen = filter_result.src_plen;
+    }
 
-    if(martian_prefix(route->prefix, route->plen) ||
-       martian_prefix(route->src_prefix, route->src_plen))
-        return;
+    if(kroute->metric >= INFINITY ||
+       martian_prefix(kroute->prefix, kroute->plen))
+        return 0;
 
-    routes[*found] = *route;
-    ++ *found;
+    if(buckets == NULL)
+        return 1;
+
+    h = xroute_hash(kroute->prefix, kroute->plen,
+                    kroute->src_prefix, kroute->src_plen);
+    return buckets[digest_bucket(h)];
 }
 
-static int
-kernel_routes(struct kernel_route *routes, int maxroutes)
+/* The exported route corresponding to a local address. */
+static void
+address_route(struct kernel_addr *addr, struct kernel_route *route)
 {
-    int found = 0;
-    void *data[3] = { &maxroutes, routes, &found };
-    struct kernel_filter filter = {0};
-    filter.route = filter_route;
-    filter.route_closure = data;
-
-    kernel_dump(CHANGE_ROUTE, &filter);
-
-    return found;
+    memset(route, 0, sizeof(struct kernel_route));
+    memcpy(route->prefix, addr->addr.s6_addr, 16);
+    route->plen = 128;
+    if(v4mapped(route->prefix)) {
+        memcpy(route->src_prefix, v4prefix, 16);
+        route->src_plen = 96;
+    }
+    route->metric = 0;
+    route->ifindex = addr->ifindex;
+    route->proto = RTPROT_BABEL_LOCAL;
+    memset(route->gw, 0, 16);
 }
 
 static void
@@ -295,17 +624,7 @@ filter_address(int add, struct kernel_addr *addr, void *data)
         return;
 
     route = &routes[*found];
-    memset(route, 0, sizeof(struct kernel_route));
-    memcpy(route->prefix, addr->addr.s6_addr, 16);
-    route->plen = 128;
-    if(v4mapped(route->prefix)) {
-        memcpy(route->src_prefix, v4prefix, 16);
-        route->src_plen = 96;
-    }
-    route->metric = 0;
-    route->ifindex = addr->ifindex;
-    route->proto = RTPROT_BABEL_LOCAL;
-    memset(route->gw, 0, 16);
+    address_route(addr, route);
     ++ *found;
 }
 
@@ -359,32 +678,63 @@ static void
 modify_xroute(int i, struct kernel_route *kroute, int update) {
     if(xroutes[i].metric != kroute->metric ||
        xroutes[i].proto != kroute->proto) {
+        int aggregate = xroutes[i].metric != kroute->metric;
+        if(aggregate)
+            unsuppress_xroute(&xroutes[i]);
+        digest_xroute(&xroutes[i], 0);
         xroutes[i].metric = kroute->metric;
         xroutes[i].proto = kroute->proto;
+        digest_xroute(&xroutes[i], 1);
         local_notify_xroute(&xroutes[i], LOCAL_CHANGE);
         if(update)
             send_update(NULL, 0, xroutes[i].prefix, xroutes[i].plen,
                         xroutes[i].src_prefix, xroutes[i].src_plen);
+        if(aggregate)
+            aggregate_xroute(xroutes[i].prefix, xroutes[i].plen,
+                             xroutes[i].src_prefix, xroutes[i].src_plen);
     }
 }
 
 static void
-flush_duplicate_route(struct kernel_route *kroute) {
+flush_duplicate_route(const unsigned char *prefix, unsigned char plen,
+                      const unsigned char *src_prefix, unsigned char src_plen,
+                      int metric) {
     struct babel_route *route;
-    route = find_installed_route(kroute->prefix, kroute->plen,
-                                 kroute->src_prefix, kroute->src_plen);
+    route = find_installed_route(prefix, plen, src_prefix, src_plen);
     if(route) {
-        if(allow_duplicates < 0 || kroute->metric < allow_duplicates)
+        if(allow_duplicates < 0 || metric < allow_duplicates)
             uninstall_route(route);
     }
 }
 
 
+/* Kernel route notifications are queued, and applied together by
+   apply_kernel_route_notifications once per main loop iteration. */
+
+struct kernel_route_event {
+    struct kernel_route route;
+    int add;
+    int seqno;
+};
+
+static int
+route_event_compare(const void *v1, const void *v2)
+{
+    const struct kernel_route_event *e1 = v1, *e2 = v2;
+    int rc = kernel_route_compare(&e1->route, &e2->route);
+
+    if(rc != 0)
+        return rc;
+    return e1->seqno < e2->seqno ? -1 : e1->seqno > e2->seqno ? 1 : 0;
+}
+
+static struct kernel_route_event *route_events = NULL;
+static int num_route_events = 0, max_route_events = 0;
+
 void
 kernel_route_notify(int add, struct kernel_route *kroute, void *closure)
 {
     struct filter_result filter_result;
-    int i, rc;
 
     debugf("Kernel route: %s %s",
            add ? "add" : "del", format_prefix(kroute->prefix, kroute->plen));
@@ -402,151 +752,521 @@ kernel_route_notify(int add, struct kernel_route *kroute, void *closure)
     if(kroute->metric >= INFINITY)
         return;
 
-    i = find_xroute_slot(kroute->prefix, kroute->plen,
-                         kroute->src_prefix, kroute->src_plen, NULL);
-    if(!add) {
-        if(i >= 0)
-            flush_xroute(&xroutes[i], 1);
-        else
-            debugf("Flushing unknown route.\n");
-        return;
+    if(num_route_events >= max_route_events) {
+        struct kernel_route_event *new_events;
+        int n = max_route_events < 1 ? 64 : 2 * max_route_events;
+        new_events = realloc(route_events,
+                             n * sizeof(struct kernel_route_event));
+        if(new_events == NULL) {
+            perror("realloc(route_events)");
+            return;
+        }
+        route_events = new_events;
+        max_route_events = n;
     }
 
+    route_events[num_route_events].route = *kroute;
+    route_events[num_route_events].add = add;
+    route_events[num_route_events].seqno = num_route_events;
+    num_route_events++;
+}
+
+/* The kernel may hold several routes with the same prefixes, of which
+   check_kernel_route keeps the first one.  The digest must only count
+   that one.  Duplicates of a prefix that we don't export need no care,
+   since its bucket disagrees anyway. */
+static void
+add_kernel_digest(unsigned long long *digest, struct kernel_route *route)
+{
+    unsigned long long h;
+    int i;
+
+    i = find_xroute_slot(route->prefix, route->plen,
+                         route->src_prefix, route->src_plen, NULL);
     if(i >= 0) {
-        modify_xroute(i, kroute, 1);
-        return;
+        if(xroutes[i].mark == XROUTE_SEEN)
+            return;
+        xroutes[i].mark = XROUTE_SEEN;
     }
 
-    if(martian_prefix(kroute->prefix, kroute->plen))
+    h = xroute_hash(route->prefix, route->plen,
+                    route->src_prefix, route->src_plen);
+    digest[digest_bucket(h)] += digest_term(h, route->metric, route->proto);
+}
+
+static void
+digest_route(int add, struct kernel_route *route, void *data)
+{
+    if(martian_prefix(route->prefix, route->plen) ||
+       martian_prefix(route->src_prefix, route->src_plen))
         return;
 
-    rc = add_xroute(kroute->prefix, kroute->plen,
-                    kroute->src_prefix, kroute->src_plen,
-                    kroute->metric, kroute->ifindex,
-                    kroute->proto);
-    if(rc > 0) {
-        flush_duplicate_route(kroute);
-        send_update(NULL, 0, kroute->prefix, kroute->plen,
-                    kroute->src_prefix, kroute->src_plen);
-    }
+    if(!select_kernel_route(route, NULL))
+        return;
 
+    add_kernel_digest(data, route);
 }
 
+static void
+digest_address(int add, struct kernel_addr *addr, void *data)
+{
+    struct kernel_route route;
 
-int
-check_xroutes(int send_updates, int warn)
+    if(IN6_IS_ADDR_LINKLOCAL(&addr->addr))
+        return;
+
+    address_route(addr, &route);
+    if(!select_kernel_route(&route, NULL))
+        return;
+
+    add_kernel_digest(data, &route);
+}
+
+/* Compute the digest of the exportable kernel routes and addresses
+   without storing them.  Addresses are dumped before routes, in the same
+   order as in reconcile_xroutes, and the xroute marks record which
+   prefixes have been counted. */
+static int
+kernel_digest(unsigned long long *digest)
 {
-    int i, j, change = 0, rc;
-    struct kernel_route *routes;
-    struct filter_result filter_result;
-    int numroutes;
-    static int maxroutes = 8;
-    const int maxmaxroutes = 256 * 1024;
+    struct kernel_filter filter = {0};
+    int i, rc;
 
-    debugf("\nChecking kernel routes.\n");
+    memset(digest, 0, XROUTE_DIGEST_BUCKETS * sizeof(unsigned long long));
+    for(i = 0; i < numxroutes; i++)
+        xroutes[i].mark = XROUTE_UNSEEN;
 
- again:
-    routes = calloc(maxroutes, sizeof(struct kernel_route));
-    if(routes == NULL)
+    filter.addr = digest_address;
+    filter.addr_closure = digest;
+    rc = kernel_dump(CHANGE_ADDR, &filter);
+    if(rc < 0)
         return -1;
 
-    rc = kernel_addresses(0, 0, routes, maxroutes);
-    if(rc < 0) {
-        perror("kernel_addresses");
-        numroutes = 0;
-    } else {
-        numroutes = rc;
+    memset(&filter, 0, sizeof(filter));
+    filter.route = digest_route;
+    filter.route_closure = digest;
+    rc = kernel_dump(CHANGE_ROUTE, &filter);
+    if(rc < 0)
+        return -1;
+
+    return 1;
+}
+
+/* Exported routes are checked by streaming the kernel tables.  Routes
+that we already export are updated in place, while new routes are
+collected in bounded runs that are sorted and merged into the xroutes
+in one pass.  Xroutes that were not seen are flushed at the end. */
+
+#define XROUTE_RUN_SIZE 16384
+
+struct xroute_check {
+    const unsigned char *buckets;
+    int local_only;
+    int send_updates;
+    struct kernel_route_event *run;
+    int runlen;
+    int error;
+};
+
+static int
+xroute_selected(const struct xroute *xroute, const unsigned char *buckets,
+                int local_only)
+{
+    if(local_only && xroute->proto != RTPROT_BABEL_LOCAL)
+        return 0;
+    if(buckets == NULL)
+        return 1;
+    return buckets[digest_bucket(xroute_hash(xroute->prefix, xroute->plen,
+                                             xroute->src_prefix,
+                                             xroute->src_plen))];
+}
+
+/* Merge a run of routes that are not yet exported into the xroutes.  The
+   seqno of each route is its position in the dump, and of duplicate
+   routes the first one wins, as in check_kernel_route. */
+static int
+merge_xroute_run(struct kernel_route_event *run, int n)
+{
+    int i, j, k;
+
+    if(n == 0)
+        return 0;
+
+    qsort(run, n, sizeof(struct kernel_route_event), route_event_compare);
+    k = 0;
+    for(i = 0; i < n; i++) {
+        if(k == 0 ||
+           kernel_route_compare(&run[k - 1].route, &run[i].route) != 0)
+            run[k++] = run[i];
     }
+    n = k;
 
-    if(numroutes >= maxroutes)
-        goto resize;
+    for(i = 0; i < n; i++)
+        dissolve_aggregate(run[i].route.prefix, run[i].route.plen,
+                           run[i].route.src_prefix, run[i].route.src_plen);
 
-    rc = kernel_routes(routes + numroutes, maxroutes - numroutes);
-    if(rc < 0)
-        fprintf(stderr, "Couldn't get kernel routes.\n");
-    else
-        numroutes += rc;
-
-    if(numroutes >= maxroutes)
-        goto resize;
-
-    for(i = 0; i < numroutes; i++) {
-        routes[i].metric = redistribute_filter(routes[i].prefix, routes[i].plen,
-                                               routes[i].src_prefix,
-                                               routes[i].src_plen,
-                                               routes[i].ifindex,
-                                               routes[i].proto,
-                                               &filter_result);
-        if(filter_result.src_prefix != NULL) {
-            memcpy(routes[i].src_prefix, filter_result.src_prefix, 16);
-            routes[i].src_plen = filter_result.src_plen;
+    if(numxroutes + n > maxxroutes) {
+        struct xroute *new_xroutes;
+        int num = maxxroutes < 8 ? 8 : maxxroutes;
+        while(num < numxroutes + n)
+            num *= 2;
+        new_xroutes = realloc(xroutes, num * sizeof(struct xroute));
+        if(new_xroutes == NULL)
+            return -1;
+        maxxroutes = num;
+        xroutes = new_xroutes;
+    }
+
+    /* Merge backwards, so that no xroute is moved more than once. */
+    i = numxroutes - 1;
+    j = n - 1;
+    k = numxroutes + n - 1;
+    while(j >= 0) {
+        struct kernel_route *kroute = &run[j].route;
+        if(i >= 0 &&
+           xroute_compare(kroute->prefix, kroute->plen,
+                          kroute->src_prefix, kroute->src_plen,
+                          &xroutes[i]) < 0) {
+            xroutes[k--] = xroutes[i--];
+        } else {
+            struct xroute *xroute = &xroutes[k--];
+            memcpy(xroute->prefix, kroute->prefix, 16);
+            xroute->plen = kroute->plen;
+            memcpy(xroute->src_prefix, kroute->src_prefix, 16);
+            xroute->src_plen = kroute->src_plen;
+            xroute->metric = kroute->metric;
+            xroute->ifindex = kroute->ifindex;
+            xroute->proto = kroute->proto;
+            xroute->mark = XROUTE_ADDED;
+            xroute->suppressed = 0;
+            xroute->aggregate = 0;
+            digest_xroute(xroute, 1);
+            j--;
         }
     }
+    numxroutes += n;
+    return n;
+}
 
-    qsort(routes, numroutes, sizeof(struct kernel_route), kernel_route_compare);
-    i = 0;
-    j = 0;
-    while(i < numroutes || j < numxroutes) {
-        /* Ignore routes filtered out. */
-        if(i < numroutes && routes[i].metric >= INFINITY) {
-            i++;
-            continue;
+/* Finish adding an xroute inserted by merge_xroute_run. */
+static void
+announce_xroute(struct xroute *xroute, int send_updates)
+{
+    assert(xroute->mark == XROUTE_ADDED);
+    xroute->mark = XROUTE_SEEN;
+    local_notify_xroute(xroute, LOCAL_ADD);
+    flush_duplicate_route(xroute->prefix, xroute->plen,
+                          xroute->src_prefix, xroute->src_plen,
+                          xroute->metric);
+    if(send_updates)
+        send_update(NULL, 0, xroute->prefix, xroute->plen,
+                    xroute->src_prefix, xroute->src_plen);
+    aggregate_xroute(xroute->prefix, xroute->plen,
+                     xroute->src_prefix, xroute->src_plen);
+}
+
+static void
+check_kernel_route(struct kernel_route *kroute, struct xroute_check *check)
+{
+    int i;
+
+    if(!select_kernel_route(kroute, check->buckets))
+        return;
+
+    i = find_xroute_slot(kroute->prefix, kroute->plen,
+                         kroute->src_prefix, kroute->src_plen, NULL);
+    if(i >= 0) {
+        if(check->local_only && xroutes[i].proto != RTPROT_BABEL_LOCAL)
+            return;
+        /* If the kernel has duplicates, the first one wins.  This must
+           agree with kernel_digest. */
+        if(xroutes[i].mark == XROUTE_UNSEEN) {
+            modify_xroute(i, kroute, check->send_updates);
+            xroutes[i].mark = XROUTE_SEEN;
         }
+        return;
+    }
+
+    check->run[check->runlen].route = *kroute;
+    check->run[check->runlen].seqno = check->runlen;
+    check->runlen++;
+    if(check->runlen >= XROUTE_RUN_SIZE) {
+        if(merge_xroute_run(check->run, check->runlen) < 0)
+            check->error = 1;
+        check->runlen = 0;
+    }
+}
+
+static void
+check_route(int add, struct kernel_route *route, void *data)
+{
+    if(martian_prefix(route->prefix, route->plen) ||
+       martian_prefix(route->src_prefix, route->src_plen))
+        return;
+
+    check_kernel_route(route, data);
+}
+
+static void
+check_address(int add, struct kernel_addr *addr, void *data)
+{
+    struct kernel_route route;
+
+    if(IN6_IS_ADDR_LINKLOCAL(&addr->addr))
+        return;
+
+    address_route(addr, &route);
+    check_kernel_route(&route, data);
+}
+
+static int
+reconcile_xroutes(int operation, const unsigned char *buckets,
+                  int local_only, int send_updates, int warn)
+{
+    struct xroute_check check;
+    struct kernel_filter filter = {0};
+    int i, rc = 1;
+
+    memset(&check, 0, sizeof(check));
+    check.buckets = buckets;
+    check.local_only = local_only;
+    check.send_updates = send_updates;
+    check.run = malloc(XROUTE_RUN_SIZE * sizeof(struct kernel_route_event));
+    if(check.run == NULL)
+        return -1;
+
+    for(i = 0; i < numxroutes; i++)
+        xroutes[i].mark = xroute_selected(&xroutes[i], buckets, local_only) ?
+            XROUTE_UNSEEN : XROUTE_SEEN;
 
-        if(i >= numroutes)
-            rc = +1;
-        else if(j >= numxroutes)
+    /* We must not touch the kernel tables until the dump is over. */
+    if(operation & CHANGE_ADDR) {
+        filter.addr = check_address;
+        filter.addr_closure = &check;
+        if(kernel_dump(CHANGE_ADDR, &filter) < 0) {
+            perror("kernel_addresses");
             rc = -1;
-        else
-            rc = xroute_compare(routes[i].prefix, routes[i].plen,
-                                routes[i].src_prefix, routes[i].src_plen,
-                                &xroutes[j]);
-        if(rc < 0) {
-            /* Add route i. */
-            if(!martian_prefix(routes[i].prefix, routes[i].plen) &&
-               routes[i].metric < INFINITY) {
-                if(warn)
-                    fprintf(stderr,
-                            "Adding missing route to %s "
-                            "(this shouldn't happen)\n",
-                            format_prefix(routes[i].prefix, routes[i].plen));
-                rc = add_xroute(routes[i].prefix, routes[i].plen,
-                                routes[i].src_prefix, routes[i].src_plen,
-                                routes[i].metric, routes[i].ifindex,
-                                routes[i].proto);
-                if(rc > 0) {
-                    flush_duplicate_route(&routes[i]);
-                    if(send_updates)
-                        send_update(NULL, 0, routes[i].prefix, routes[i].plen,
-                                    routes[i].src_prefix, routes[i].src_plen);
-                    j++;
-                }
+        }
+    }
+    if((operation & CHANGE_ROUTE) && rc >= 0) {
+        memset(&filter, 0, sizeof(filter));
+        filter.route = check_route;
+        filter.route_closure = &check;
+        if(kernel_dump(CHANGE_ROUTE, &filter) < 0) {
+            fprintf(stderr, "Couldn't get kernel routes.\n");
+            rc = -1;
+        }
+    }
+
+    if(merge_xroute_run(check.run, check.runlen) < 0)
+        check.error = 1;
+    free(check.run);
+    if(check.error) {
+        fprintf(stderr, "Couldn't allocate exported routes.\n");
+        rc = -1;
+    }
+
+    i = 0;
+    while(i < numxroutes) {
+        struct xroute *xroute = &xroutes[i];
+        if(xroute->mark == XROUTE_UNSEEN) {
+            /* A partial dump doesn't tell us what is missing. */
+            if(rc < 0) {
+                i++;
+                continue;
             }
-            i++;
-        } else if(rc > 0) {
-            /* Flush xroute j. */
             if(warn)
                 fprintf(stderr,
                         "Flushing spurious route to %s "
                         "(this shouldn't happen)\n",
-                        format_prefix(xroutes[j].prefix, xroutes[j].plen));
-            flush_xroute(&xroutes[j], send_updates);
-        } else {
-            modify_xroute(j, &routes[i], send_updates);
-            i++;
-            j++;
+                        format_prefix(xroute->prefix, xroute->plen));
+            flush_xroute(xroute, send_updates);
+            continue;
         }
+        if(xroute->mark == XROUTE_ADDED) {
+            if(warn)
+                fprintf(stderr,
+                        "Adding missing route to %s "
+                        "(this shouldn't happen)\n",
+                        format_prefix(xroute->prefix, xroute->plen));
+            announce_xroute(xroute, send_updates);
+        }
+        i++;
     }
 
-    free(routes);
-    /* Set up maxroutes for the next call. */
-    maxroutes = MIN(numroutes + 8, maxmaxroutes);
-    return change;
+    return rc;
+}
 
- resize:
-    free(routes);
-    if(maxroutes >= maxmaxroutes)
-        return -1;
-    maxroutes = MIN(maxmaxroutes, 2 * maxroutes);
-    goto again;
+static void
+announce_xroute_run(struct kernel_route_event *run, int n)
+{
+    int i, j;
+
+    n = merge_xroute_run(run, n);
+    if(n < 0) {
+        fprintf(stderr, "Couldn't allocate exported routes.\n");
+        return;
+    }
+
+    for(i = 0; i < n; i++) {
+        j = find_xroute_slot(run[i].route.prefix, run[i].route.plen,
+                             run[i].route.src_prefix, run[i].route.src_plen,
+                             NULL);
+        assert(j >= 0);
+        announce_xroute(&xroutes[j], 1);
+    }
+}
+
+/* Apply the kernel route notifications queued since the last call.  Only
+   the last notification for each prefix matters.  New xroutes are merged
+   into the table in sorted runs, and removed ones are compacted out in a
+   single pass, so that a burst of notifications costs time linear in the
+   size of the table rather than quadratic. */
+void
+apply_kernel_route_notifications(void)
+{
+    struct kernel_route_event *run;
+    int i, j, n = 0, removed = 0;
+
+    if(num_route_events == 0)
+        return;
+
+    debugf("Applying %d kernel route notifications.\n", num_route_events);
+
+    qsort(route_events, num_route_events, sizeof(struct kernel_route_event),
+          route_event_compare);
+
+    run = malloc(XROUTE_RUN_SIZE * sizeof(struct kernel_route_event));
+
+    for(i = 0; i < num_route_events; i++) {
+        struct kernel_route *kroute = &route_events[i].route;
+
+        if(i + 1 < num_route_events &&
+           kernel_route_compare(kroute, &route_events[i + 1].route) == 0) {
+            /* Superseded. */
+            route_events[i].add = -1;
+            continue;
+        }
+
+        j = find_xroute_slot(kroute->prefix, kroute->plen,
+                             kroute->src_prefix, kroute->src_plen, NULL);
+
+        if(!route_events[i].add) {
+            if(j >= 0) {
+                retire_xroute(&xroutes[j]);
+                xroutes[j].mark = XROUTE_DELETED;
+                removed++;
+            } else {
+                debugf("Flushing unknown route.\n");
+                route_events[i].add = -1;
+            }
+            continue;
+        }
+
+        route_events[i].add = -1;
+
+        if(j >= 0) {
+            modify_xroute(j, kroute, 1);
+            continue;
+        }
+
+        if(martian_prefix(kroute->prefix, kroute->plen))
+            continue;
+
+        if(run == NULL) {
+            /* Fall back to adding routes one at a time. */
+            if(add_xroute(kroute->prefix, kroute->plen,
+                          kroute->src_prefix, kroute->src_plen,
+                          kroute->metric, kroute->ifindex,
+                          kroute->proto) > 0) {
+                flush_duplicate_route(kroute->prefix, kroute->plen,
+                                      kroute->src_prefix, kroute->src_plen,
+                                      kroute->metric);
+                send_update(NULL, 0, kroute->prefix, kroute->plen,
+                            kroute->src_prefix, kroute->src_plen);
+            }
+            continue;
+        }
+
+        run[n].route = *kroute;
+        run[n].seqno = n;
+        n++;
+        if(n >= XROUTE_RUN_SIZE) {
+            announce_xroute_run(run, n);
+            n = 0;
+        }
+    }
+
+    if(run != NULL) {
+        announce_xroute_run(run, n);
+        free(run);
+    }
+
+    if(removed > 0) {
+        j = 0;
+        for(i = 0; i < numxroutes; i++) {
+            if(xroutes[i].mark != XROUTE_DELETED)
+                xroutes[j++] = xroutes[i];
+        }
+        numxroutes = j;
+        shrink_xroutes();
+
+        /* The remaining events are the removals. */
+        for(i = 0; i < num_route_events; i++) {
+            struct kernel_route *kroute = &route_events[i].route;
+            if(route_events[i].add != 0)
+                continue;
+            xroute_removed(kroute->prefix, kroute->plen,
+                           kroute->src_prefix, kroute->src_plen, 1);
+        }
+    }
+
+    num_route_events = 0;
+    if(max_route_events > 1024) {
+        free(route_events);
+        route_events = NULL;
+        max_route_events = 0;
+    }
+}
+
+/* Reconcile the routes derived from local addresses.  This is called
+   when addresses change, and doesn't need to dump the routing table. */
+int
+check_xaddresses(int send_updates)
+{
+    debugf("\nChecking local addresses.\n");
+    return reconcile_xroutes(CHANGE_ADDR, NULL, 1, send_updates, 0);
+}
+
+/* Check the exported routes against the kernel.  We first compare
+   digests, and only reconcile the buckets that disagree. */
+int
+check_xroutes(int send_updates, int warn)
+{
+    unsigned long long digest[XROUTE_DIGEST_BUCKETS];
+    unsigned char buckets[XROUTE_DIGEST_BUCKETS];
+    int i, rc, numbuckets = 0;
+
+    debugf("\nChecking kernel routes.\n");
+
+    rc = kernel_digest(digest);
+    if(rc < 0) {
+        fprintf(stderr, "Couldn't compute kernel digest.\n");
+        memset(buckets, 1, sizeof(buckets));
+        numbuckets = XROUTE_DIGEST_BUCKETS;
+    } else {
+        for(i = 0; i < XROUTE_DIGEST_BUCKETS; i++) {
+            buckets[i] = digest[i] != xroute_digest[i];
+            numbuckets += buckets[i];
+        }
+    }
+
+    if(numbuckets == 0)
+        return 0;
+
+    debugf("%d of %d buckets differ.\n", numbuckets, XROUTE_DIGEST_BUCKETS);
+
+    rc = reconcile_xroutes(CHANGE_ADDR | CHANGE_ROUTE, buckets, 0,
+                           send_updates, warn);
+    return rc < 0 ? -1 : 0;
 }
@@ -28,8 +28,13 @@ struct xroute {
     unsigned short metric;
     unsigned int ifindex;
     int proto;
+    unsigned char mark;         /* used by check_xroutes */
+    unsigned char suppressed;   /* covered by an aggregate */
+    unsigned char aggregate;
 };
 
+extern int aggregate_xroutes;
+
 struct xroute_stream;
 
 struct xroute *find_xroute(const unsigned char *prefix, unsigned char plen,
@@ -38,6 +43,7 @@ int add_xroute(unsigned char prefix[16], unsigned char plen,
                unsigned char src_prefix[16], unsigned char src_plen,
                unsigned short metric, unsigned int ifindex, int proto);
 void flush_xroute(struct xroute *xroute, int send_update);
+void set_xroute_aggregation(int on);
 int xroutes_estimate(void);
 struct xroute_stream *xroute_stream();
 struct xroute *xroute_stream_next(struct xroute_stream *stream);
@@ -45,4 +51,6 @@ void xroute_stream_done(struct xroute_stream *stream);
 int kernel_addresses(int ifindex, int ll,
                      struct kernel_route *routes, int maxroutes);
 void kernel_route_notify(int add, struct kernel_route *route, void *closure);
+void apply_kernel_route_notifications(void);
+int check_xaddresses(int send_updates);
 int check_xroutes(int send_updates, int warn);